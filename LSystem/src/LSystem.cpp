@@ -1,24 +1,247 @@
 #include "LSystem.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
-#include <stack>
+#include <iterator>
+#include <unordered_map>
+#include "parallel.h"
 
-#pragma warning(disable : 4244)
-#pragma warning(disable : 4290)
-#include "matrix.h"
-
-#define Rad2Deg 57.295779513082320876798154814105
 #define Deg2Rad 0.017453292519943295769236907684886
 
-LSystem::LSystem() : mDfltAngle(22.5), mDfltStep(1.0) {}
+// Symbols the turtle interprets by default; everything else is emitted as a model
+constexpr struct
+{
+    char symbol;
+    LSystem::TurtleOp op;
+    float scale;
+} k_TURTLE_COMMANDS[] = { { 'F', LSystem::TurtleOp::Draw, 1.0f },
+                          { 'f', LSystem::TurtleOp::Move, 1.0f },
+                          { '+', LSystem::TurtleOp::Turn, 1.0f },
+                          { '-', LSystem::TurtleOp::Turn, -1.0f },
+                          { '&', LSystem::TurtleOp::Pitch, 1.0f },
+                          { '^', LSystem::TurtleOp::Pitch, -1.0f },
+                          { '\\', LSystem::TurtleOp::Roll, 1.0f },
+                          { '/', LSystem::TurtleOp::Roll, -1.0f },
+                          { '|', LSystem::TurtleOp::TurnAround, 1.0f },
+                          { '[', LSystem::TurtleOp::Push, 1.0f },
+                          { ']', LSystem::TurtleOp::Pop, 1.0f } };
+
+// Grammar punctuation, which can't be part of a multi-character name
+constexpr const char* k_NAME_DELIMITERS = "()[],:<>";
+
+// Inputs shorter than this are rewritten or interpreted serially; thread start-up would cost more
+// than it saves
+constexpr size_t k_PARALLEL_MIN_SYMBOLS = 1 << 20;
+
+// Most branches or models process() reserves up front
+constexpr uint64_t k_MAX_RESERVE = 1 << 26;
+
+LSystem::LSystem()
+    : mUseClock(0)
+    , mCachePolicy(CachePolicy::KeepAll)
+    , mCacheBudget(0)
+    , mStochastic(false)
+    , mSeed(0)
+    , mGeneration(0)
+    , mContextSensitive(false)
+    , mParametric(false)
+    , mModulesIteration(-1)
+    , mCurrentIteration(-1)
+    , mDfltAngle(22.5)
+    , mDfltStep(1.0)
+    , mThreadCount(resolveThreadCount(0))
+    , mParallelTurtle(false)
+    , mBudget{ 0, 0, 0 }
+    , mDetail{ vec3(0, 0, 0), 0.0f, 0, 0.0f }
+    , mLastResult{ Status::Ok, -1 }
+{
+    compileProductions();
+}
 
 void LSystem::setDefaultAngle(float degrees)
 {
     mDfltAngle = degrees;
+    buildCommands();
 }
 
 void LSystem::setDefaultStep(float distance)
 {
     mDfltStep = distance;
+    buildCommands();
+}
+
+void LSystem::setSeed(uint32_t seed)
+{
+    if (seed != mSeed && mStochastic)
+    {
+        clearIterations();  // every cached iteration belongs to the old seed
+    }
+    mSeed = seed;
+}
+
+uint32_t LSystem::getSeed() const
+{
+    return mSeed;
+}
+
+void LSystem::setBudget(const Budget& budget)
+{
+    mBudget = budget;
+}
+
+const LSystem::Budget& LSystem::getBudget() const
+{
+    return mBudget;
+}
+
+void LSystem::setDetail(const Detail& detail)
+{
+    mDetail = detail;
+}
+
+const LSystem::Detail& LSystem::getDetail() const
+{
+    return mDetail;
+}
+
+bool LSystem::isCulling() const
+{
+    return mDetail.minProjectedLength > 0.0f || mDetail.maxDepth > 0
+           || (mDetail.leafFraction > 0.0f && mDetail.leafFraction < 1.0f);
+}
+
+bool LSystem::registerCommand(const std::string& symbol, TurtleOp op, float scale)
+{
+    if (symbol.empty() || symbol == "[" || symbol == "]" || op == TurtleOp::Push
+        || op == TurtleOp::Pop)
+    {
+        return false;
+    }
+
+    // a name that isn't interned yet gets a code now, and the grammar is read again with it
+    bool interned = tokenize(symbol).size() == 1;
+    if (!interned && (symbol.find_first_of(k_NAME_DELIMITERS) != std::string::npos
+                      || mNamesByLength.size() == 256 - k_FIRST_NAME))
+    {
+        return false;
+    }
+    mRegisteredCommands[symbol] = { op, scale };
+    if (interned)
+    {
+        buildCommands();
+    }
+    else
+    {
+        std::string program = mGrammar;  // loading starts by clearing mGrammar
+        loadProgramFromString(program);
+    }
+    return true;
+}
+
+void LSystem::resetCommands()
+{
+    mRegisteredCommands.clear();
+    buildCommands();
+}
+
+void LSystem::buildCommands()
+{
+    for (Command& command : mCommands)
+    {
+        command = { TurtleOp::Model, 1.0f, 0.0f, Rotation() };
+    }
+    for (const auto& command : k_TURTLE_COMMANDS)
+    {
+        Command& entry = mCommands[static_cast<unsigned char>(command.symbol)];
+        entry = { command.op, command.scale, 0.0f, Rotation() };  // step resolved below
+    }
+    for (const auto& [name, command] : mRegisteredCommands)
+    {
+        std::string symbol = tokenize(name);
+        if (symbol.size() == 1)
+        {
+            Command& entry = mCommands[static_cast<unsigned char>(symbol[0])];
+            entry = { command.first, command.second, 0.0f, Rotation() };
+        }
+    }
+
+    // resolve the defaults now, so the per-symbol path only looks them up
+    for (Command& command : mCommands)
+    {
+        command.step = command.scale * mDfltStep;
+        if (command.op == TurtleOp::Turn || command.op == TurtleOp::Pitch
+            || command.op == TurtleOp::Roll)
+        {
+            command.rotation = Rotation(command.scale * mDfltAngle);
+        }
+        else if (command.op == TurtleOp::TurnAround)
+        {
+            command.rotation = Rotation(180.0);
+        }
+    }
+}
+
+const LSystem::Result& LSystem::getLastResult() const
+{
+    return mLastResult;
+}
+
+bool LSystem::isStochastic() const
+{
+    return mStochastic;
+}
+
+bool LSystem::isParametric() const
+{
+    return mParametric;
+}
+
+bool LSystem::isContextSensitive() const
+{
+    return mContextSensitive;
+}
+
+const std::vector<std::string>& LSystem::getErrors() const
+{
+    return mErrors;
+}
+
+const std::string& LSystem::getSymbolName(unsigned char sym) const
+{
+    return mSymbolNames[sym];
+}
+
+std::string LSystem::toText(const std::string& symbols) const
+{
+    if (mNamesByLength.empty())
+    {
+        return symbols;
+    }
+
+    std::string text;
+    text.reserve(symbols.size());
+    for (char sym : symbols)
+    {
+        text += mSymbolNames[static_cast<unsigned char>(sym)];
+    }
+    return text;
+}
+
+void LSystem::setThreadCount(unsigned int threads)
+{
+    mThreadCount = resolveThreadCount(threads);
+}
+
+void LSystem::setParallelInterpretation(bool enable)
+{
+    mParallelTurtle = enable;
+}
+
+unsigned int LSystem::getThreadCount() const
+{
+    return mThreadCount;
 }
 
 float LSystem::getDefaultAngle() const
@@ -39,227 +262,2760 @@ const std::string& LSystem::getGrammarString() const
 void LSystem::reset()
 {
     mGrammar = "";
-    current = "";
-    iterations.clear();
+    mAxiomText = "";
     productions.clear();
+    mParametricProductions.clear();
+    mContextProductions.clear();
+    mDeclaredNames.clear();
+    mIgnoreList = "";
+    mErrors.clear();
+    compileProductions();
+    clearIterations();
+}
+
+void LSystem::clearIterations()
+{
+    current = mAxiom;
+    mCurrentIteration = -1;
+    mModules = mAxiomModules;
+    mModulesIteration = -1;
+    iterations.clear();
+    mLastUse.clear();
 }
 
 const std::string& LSystem::getIteration(unsigned int n)
 {
+    mLastResult = { Status::Ok, static_cast<int>(n) };
+    if (n < iterations.size() && mLastUse[n] != 0)
+    {
+        mLastUse[n] = ++mUseClock;
+        return iterations[n];
+    }
+
     if (n >= iterations.size())
     {
-        for (unsigned int i = iterations.size(); i <= n; i++)
+        iterations.resize(n + 1);
+        mLastUse.resize(n + 1, 0);
+    }
+
+    if (mParametric)
+    {
+        const ModuleString& modules = getModules(n);
+        if (!mLastResult.ok())
         {
-            current = iterate(current);
-            iterations.push_back(current);
+            formatModules(modules, current);  // the deepest iteration that fit
+            return current;
         }
+        formatModules(modules, iterations[n]);
+        mLastUse[n] = ++mUseClock;
+        evictIterations(n);
+        return iterations[n];
     }
-    return iterations[n];
-}
 
-void LSystem::loadProgram(const std::string& fileName)
-{
-    reset();
+    // Start from the nearest resident ancestor, or from whatever the rewrite buffer holds if closer
+    int ancestor = static_cast<int>(n) - 1;
+    while (ancestor >= 0 && mLastUse[ancestor] == 0)
+    {
+        ancestor--;
+    }
+    if (mCurrentIteration < ancestor || mCurrentIteration > static_cast<int>(n))
+    {
+        current = ancestor >= 0 ? iterations[ancestor] : mAxiom;
+        mCurrentIteration = ancestor;
+    }
 
-    std::string line;
-    std::ifstream file(fileName.c_str());
-    if (file.is_open())
+    for (unsigned int i = mCurrentIteration + 1; i <= n; i++)
     {
-        while (file.good())
+        Status limit;
+        if (!iterate(current, mScratch, i, getSymbolAllowance(limit)))
         {
-            getline(file, line);
-            addProduction(line);
+            // the rewrite buffer holds the deepest iteration that fit, so keep it resident too
+            int fit = static_cast<int>(i) - 1;
+            mLastResult = { limit, fit };
+            if (fit < 0)
+            {
+                evictIterations(n);
+                return current;
+            }
+            if (mLastUse[fit] == 0)
+            {
+                iterations[fit] = current;
+            }
+            mLastUse[fit] = ++mUseClock;
+            evictIterations(fit);
+            return iterations[fit];
+        }
+        current.swap(mScratch);
+        mCurrentIteration = i;
+
+        if (mCachePolicy == CachePolicy::KeepAll || i == n)
+        {
+            iterations[i] = current;
+            mLastUse[i] = ++mUseClock;
         }
     }
-    // for each line in p, add production
-    file.close();
+
+    // A stop at the budget can leave the rewrite buffer at n without n being resident
+    if (mLastUse[n] == 0)
+    {
+        iterations[n] = current;
+        mLastUse[n] = ++mUseClock;
+    }
+
+    evictIterations(n);
+    return iterations[n];
 }
 
-void LSystem::loadProgramFromString(const std::string& program)
+// Longest iteration the budget still allows, and which limit that is
+uint64_t LSystem::getSymbolAllowance(Status& limit) const
 {
-    reset();
-    mGrammar = program;
-
-    size_t index = 0;
-    while (index < program.size())
+    uint64_t allowance = mBudget.maxSymbols > 0 ? mBudget.maxSymbols : UINT64_MAX;
+    limit = Status::SymbolLimit;
+    if (mBudget.maxBytes > 0)
     {
-        size_t nextIndex = program.find("\n", index);
-        std::string line = program.substr(index, nextIndex - index);
-        addProduction(line);
-        if (nextIndex == std::string::npos)
+        // the rewrite buffer grows to the new iteration, and the cache may keep a copy of it
+        size_t resident = getResidentBytes() - mScratch.capacity();
+        uint64_t bytes = resident < mBudget.maxBytes ? (mBudget.maxBytes - resident) / 2 : 0;
+        if (bytes < allowance)
         {
-            break;
+            allowance = bytes;
+            limit = Status::MemoryLimit;
         }
-        index = nextIndex + 1;
     }
+    return allowance;
 }
 
-void LSystem::addProduction(std::string line)
+LSystem::Result LSystem::checkBudget(unsigned int n) const
 {
-    size_t index;
-
-    // 1. Strip whitespace
-    while ((index = line.find(" ")) != std::string::npos)
+    if (mBudget.maxSymbols == 0 && mBudget.maxBranches == 0 && mBudget.maxBytes == 0)
     {
-        line.replace(index, 1, "");
+        return { Status::Ok, static_cast<int>(n) };
     }
 
-    if (line.size() == 0)
-    {
-        return;
-    }
-
-    // 2. Split productions
-    index = line.find("->");
-    if (index != std::string::npos)
+    for (unsigned int i = 0; i <= n; i++)
     {
-        std::string symFrom = line.substr(0, index);
-        std::string symTo = line.substr(index + 2);
-        productions[symFrom] = symTo;
-    }
-    else  // assume its the start sym
-    {
-        current = line;
+        GrowthStats stats = analyzeGrowth(i);
+        uint64_t bytes = stats.branches * sizeof(Branch) + stats.models * sizeof(Geometry);
+        if (stats.saturated || (mBudget.maxSymbols > 0 && stats.symbols > mBudget.maxSymbols))
+        {
+            return { Status::SymbolLimit, static_cast<int>(i) - 1 };
+        }
+        if (mBudget.maxBranches > 0 && stats.branches > mBudget.maxBranches)
+        {
+            return { Status::BranchLimit, static_cast<int>(i) - 1 };
+        }
+        if (mBudget.maxBytes > 0 && bytes > mBudget.maxBytes)
+        {
+            return { Status::MemoryLimit, static_cast<int>(i) - 1 };
+        }
     }
+    return { Status::Ok, static_cast<int>(n) };
 }
 
-std::string LSystem::iterate(const std::string& input)
+void LSystem::setCachePolicy(CachePolicy policy, size_t byteBudget)
 {
-    std::string output = "";
-    for (unsigned int i = 0; i < input.size(); i++)
-    {
-        std::string sym = input.substr(i, 1);
-        std::string next = productions.count(sym) > 0 ? productions[sym] : sym;
-        output = output + next;
-    }
-    return output;
-    // for each sym in current state, replace the sym
+    mCachePolicy = policy;
+    mCacheBudget = byteBudget;
 }
 
-LSystem::Turtle::Turtle() : pos(0, 0, 0), up(0, 0, 1), forward(1, 0, 0), left(0, 1, 0) {}
-
-LSystem::Turtle::Turtle(const LSystem::Turtle& t)
+LSystem::CachePolicy LSystem::getCachePolicy() const
 {
-    pos = t.pos;
-    up = t.up;
-    forward = t.forward;
-    left = t.left;
+    return mCachePolicy;
 }
 
-LSystem::Turtle& LSystem::Turtle::operator=(const LSystem::Turtle& t)
+size_t LSystem::getResidentBytes() const
 {
-    if (&t == this)
+    size_t bytes = current.capacity() + mScratch.capacity();
+    for (unsigned int i = 0; i < iterations.size(); i++)
     {
-        return *this;
+        if (mLastUse[i] != 0)
+        {
+            bytes += iterations[i].capacity();
+        }
     }
-
-    pos = t.pos;
-    up = t.up;
-    forward = t.forward;
-    left = t.left;
-    return *this;
+    return bytes;
 }
 
-void LSystem::Turtle::moveForward(float length)
+void LSystem::evictIterations(unsigned int keep)
 {
-    pos = pos + length * forward;
-}
+    auto evict = [this](unsigned int i)
+    {
+        std::string().swap(iterations[i]);  // release the memory, not just the contents
+        mLastUse[i] = 0;
+    };
 
-void LSystem::Turtle::applyUpRot(float degrees)
-{
-    math::RotationMatrix<float> mat(2, Deg2Rad * degrees);  // Z axis
-    math::RotationMatrix<float> world2local(forward, left, up);
-    up = world2local * mat * vec3(0, 0, 1);
-    left = world2local * mat * vec3(0, 1, 0);
-    forward = world2local * mat * vec3(1, 0, 0);
+    if (mCachePolicy == CachePolicy::KeepLatest)
+    {
+        for (unsigned int i = 0; i < iterations.size(); i++)
+        {
+            if (i != keep && mLastUse[i] != 0)
+            {
+                evict(i);
+            }
+        }
+    }
+    else if (mCachePolicy == CachePolicy::ByteBudget)
+    {
+        while (getResidentBytes() > mCacheBudget)
+        {
+            unsigned int oldest = keep;
+            for (unsigned int i = 0; i < iterations.size(); i++)
+            {
+                if (i != keep && mLastUse[i] != 0
+                    && (oldest == keep || mLastUse[i] < mLastUse[oldest]))
+                {
+                    oldest = i;
+                }
+            }
+            if (oldest == keep)
+            {
+                break;  // the requested iteration always stays resident
+            }
+            evict(oldest);
+        }
+    }
 }
 
-void LSystem::Turtle::applyLeftRot(float degrees)
+static uint64_t saturatingAdd(uint64_t a, uint64_t b)
 {
-    math::RotationMatrix<float> mat(1, Deg2Rad * degrees);  // Y axis
-    math::RotationMatrix<float> world2local(forward, left, up);
-    up = world2local * mat * vec3(0, 0, 1);
-    left = world2local * mat * vec3(0, 1, 0);
-    forward = world2local * mat * vec3(1, 0, 0);
+    return b > UINT64_MAX - a ? UINT64_MAX : a + b;
 }
 
-void LSystem::Turtle::applyForwardRot(float degrees)
+bool LSystem::predictSymbolCounts(unsigned int n, std::array<uint64_t, 256>& counts) const
 {
-    math::RotationMatrix<float> mat(0, Deg2Rad * degrees);  // X axis
-    math::RotationMatrix<float> world2local(forward, left, up);
-    up = world2local * mat * vec3(0, 0, 1);
-    left = world2local * mat * vec3(0, 1, 0);
-    forward = world2local * mat * vec3(1, 0, 0);
-}
+    counts.fill(0);
+    for (unsigned char sym : mAxiom)
+    {
+        counts[sym]++;
+    }
 
-void LSystem::process(unsigned int n, std::vector<Branch>& branches)
-{
-    std::vector<Geometry> models;
-    process(n, branches, models);
+    // Each rewrite multiplies the Parikh vector by the production count matrix, applied here one
+    // successor at a time since most rows of the matrix are identity rows
+    bool saturated = false;
+    std::array<uint64_t, 256> next;
+    for (unsigned int i = 0; i <= n; i++)
+    {
+        next.fill(0);
+        for (unsigned int sym = 0; sym < 256; sym++)
+        {
+            if (counts[sym] == 0)
+            {
+                continue;
+            }
+
+            const Successor& successor = mSuccessors[sym];
+            for (uint32_t j = 0; j < successor.length; j++)
+            {
+                uint64_t& count = next[static_cast<unsigned char>(mSuccessorData[successor.offset + j])];
+                count = saturatingAdd(count, counts[sym]);
+                saturated |= count == UINT64_MAX;
+            }
+        }
+        counts = next;
+    }
+    return saturated;
 }
 
-void LSystem::process(unsigned int n, std::vector<Branch>& branches, std::vector<Geometry>& models)
+void LSystem::applyExpectedCounts(const std::array<double, 256>& weights,
+                                  std::array<double, 256>& next) const
 {
-    Turtle turtle;
-    std::stack<Turtle> stack;
+    next.fill(0.0);
+    for (unsigned int sym = 0; sym < 256; sym++)
+    {
+        if (weights[sym] == 0.0)
+        {
+            continue;
+        }
 
-    // Init so we're pointing up
-    turtle.applyLeftRot(-90);
+        // deterministic symbols are a single alternative with probability 1
+        const Range& alternatives = mAlternatives[sym];
+        uint32_t count = alternatives.count == 0 ? 1 : alternatives.count;
+        float previousThreshold = 0.0f;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            const Successor& successor = alternatives.count == 0
+                                             ? mSuccessors[sym]
+                                             : mStochasticSuccessors[alternatives.first + i];
+            double weight = weights[sym];
+            if (alternatives.count != 0)
+            {
+                float threshold = mStochasticThresholds[alternatives.first + i];
+                weight *= threshold - previousThreshold;
+                previousThreshold = threshold;
+            }
+
+            for (uint32_t j = 0; j < successor.length; j++)
+            {
+                next[static_cast<unsigned char>(mSuccessorData[successor.offset + j])] += weight;
+            }
+        }
+    }
+}
 
-    std::string insn = getIteration(n);
-    for (unsigned int i = 0; i < insn.size(); i++)
+LSystem::GrowthStats LSystem::analyzeGrowth(unsigned int n) const
+{
+    GrowthStats stats;
+    stats.exact = !mStochastic && !mParametric && !mContextSensitive;
+    if (stats.exact)
     {
-        std::string sym = insn.substr(i, 1);
-        if (sym == "F")
+        stats.saturated = predictSymbolCounts(n, stats.symbolCounts);
+    }
+    else
+    {
+        // expected counts: the matrix entries become probability-weighted successor counts
+        std::array<double, 256> expected;
+        std::array<double, 256> next;
+        expected.fill(0.0);
+        for (unsigned char sym : mAxiom)
         {
-            vec3 start = turtle.pos;
-            turtle.moveForward(mDfltStep);
-            branches.push_back(Branch(start, turtle.pos));
+            expected[sym] += 1.0;
         }
-        else if (sym == "f")
+        for (unsigned int i = 0; i <= n; i++)
         {
-            turtle.moveForward(mDfltStep);
+            applyExpectedCounts(expected, next);
+            expected = next;
         }
-        else if (sym == "+")
+
+        stats.saturated = false;
+        for (unsigned int sym = 0; sym < 256; sym++)
         {
-            turtle.applyUpRot(mDfltAngle);
+            bool fits = expected[sym] < static_cast<double>(UINT64_MAX);
+            stats.symbolCounts[sym] = fits ? static_cast<uint64_t>(expected[sym] + 0.5) : UINT64_MAX;
+            stats.saturated |= !fits;
         }
-        else if (sym == "-")
+    }
+
+    stats.symbols = 0;
+    stats.branches = 0;
+    stats.models = 0;
+    for (unsigned int sym = 0; sym < 256; sym++)
+    {
+        stats.symbols = saturatingAdd(stats.symbols, stats.symbolCounts[sym]);
+        if (mCommands[sym].op == TurtleOp::Draw)
         {
-            turtle.applyUpRot(-mDfltAngle);
+            stats.branches = saturatingAdd(stats.branches, stats.symbolCounts[sym]);
         }
-        else if (sym == "&")
+        else if (mCommands[sym].op == TurtleOp::Model)
         {
-            turtle.applyLeftRot(mDfltAngle);
+            stats.models = saturatingAdd(stats.models, stats.symbolCounts[sym]);
         }
-        else if (sym == "^")
+    }
+    stats.vertices = stats.branches > UINT64_MAX / k_VERTICES_PER_BRANCH
+                         ? UINT64_MAX
+                         : stats.branches * k_VERTICES_PER_BRANCH;
+
+    // Growth rate is the dominant eigenvalue of the count matrix, found by power iteration on a
+    // normalized copy of the Parikh vector so it never overflows
+    std::array<double, 256> weights;
+    std::array<double, 256> next;
+    weights.fill(0.0);
+    for (unsigned char sym : mAxiom)
+    {
+        weights[sym] += 1.0 / mAxiom.size();
+    }
+
+    stats.growthRate = mAxiom.empty() ? 0.0 : 1.0;
+    for (unsigned int i = 0; i < 64; i++)
+    {
+        applyExpectedCounts(weights, next);
+
+        double total = 0.0;
+        for (unsigned int sym = 0; sym < 256; sym++)
         {
-            turtle.applyLeftRot(-mDfltAngle);
+            total += next[sym];
         }
-        else if (sym == "\\")
+        if (total == 0.0)
         {
-            turtle.applyForwardRot(mDfltAngle);
+            stats.growthRate = 0.0;
+            break;
         }
-        else if (sym == "/")
+
+        stats.growthRate = total;  // weights always sum to 1
+        for (unsigned int sym = 0; sym < 256; sym++)
         {
-            turtle.applyForwardRot(-mDfltAngle);
+            weights[sym] = next[sym] / total;
         }
-        else if (sym == "|")
+    }
+    return stats;
+}
+
+// Blocks whose bracket counts show they can neither go below the lowest depth nor above the
+// highest one seen so far are skipped without following the depth symbol by symbol. Counting is
+// a compare and add per byte, which compilers vectorize.
+LSystem::BracketProfile LSystem::scanBrackets(const char* begin, const char* end)
+{
+    constexpr size_t k_BLOCK = 64;
+    BracketProfile profile = { 0, 0, 0 };
+    for (const char* block = begin; block != end;)
+    {
+        size_t length = std::min(static_cast<size_t>(end - block), k_BLOCK);
+        unsigned int pushes = 0;
+        unsigned int pops = 0;
+        for (size_t i = 0; i < length; i++)
         {
-            turtle.applyUpRot(180);
+            pushes += block[i] == '[';
+            pops += block[i] == ']';
         }
-        else if (sym == "[")
+
+        if (profile.net - pops < profile.minDepth || profile.net + pushes > profile.maxDepth)
         {
-            stack.push(turtle);
+            int64_t depth = profile.net;
+            for (size_t i = 0; i < length; i++)
+            {
+                depth += (block[i] == '[') - (block[i] == ']');
+                profile.minDepth = std::min(profile.minDepth, depth);
+                profile.maxDepth = std::max(profile.maxDepth, depth);
+            }
         }
-        else if (sym == "]")
+        profile.net += static_cast<int64_t>(pushes) - pops;
+        block += length;
+    }
+    return profile;
+}
+
+// Profiles compose like the symbol counts: a symbol rewritten once more is the concatenation of
+// its successor's symbols rewritten as often as before. Alternatives of a stochastic symbol give
+// a bound rather than the exact profile, so false is returned unless that bound proves the string
+// balanced, as it does whenever every alternative is balanced.
+bool LSystem::predictBrackets(unsigned int n, BracketProfile& profile) const
+{
+    if (mParametric || mContextSensitive)
+    {
+        return false;
+    }
+
+    // depths of unbalanced grammars grow exponentially, so they are clamped well short of overflow
+    constexpr int64_t k_MAX_DEPTH = INT64_MAX / 4;
+    auto concatenate = [&](BracketProfile& run, const BracketProfile& next)
+    {
+        run.minDepth = std::min(run.minDepth, run.net + next.minDepth);
+        run.maxDepth = std::max(run.maxDepth, run.net + next.maxDepth);
+        run.net = std::max(-k_MAX_DEPTH, std::min(run.net + next.net, k_MAX_DEPTH));
+        run.minDepth = std::max(run.minDepth, -k_MAX_DEPTH);
+        run.maxDepth = std::min(run.maxDepth, k_MAX_DEPTH);
+    };
+
+    std::array<BracketProfile, 256> profiles;
+    std::array<BracketProfile, 256> next;
+    for (unsigned int sym = 0; sym < 256; sym++)
+    {
+        char c = static_cast<char>(sym);
+        profiles[sym] = scanBrackets(&c, &c + 1);
+    }
+
+    auto expand = [&](const Successor& successor)
+    {
+        BracketProfile run = { 0, 0, 0 };
+        for (uint32_t j = 0; j < successor.length; j++)
         {
-            turtle = stack.top();
-            stack.pop();
+            unsigned char sym = static_cast<unsigned char>(mSuccessorData[successor.offset + j]);
+            concatenate(run, profiles[sym]);
         }
-        else
+        return run;
+    };
+
+    for (unsigned int i = 0; i <= n; i++)
+    {
+        for (unsigned int sym = 0; sym < 256; sym++)
         {
-            models.push_back(Geometry(turtle.pos, sym));
+            const Range& alternatives = mAlternatives[sym];
+            if (alternatives.count == 0)
+            {
+                next[sym] = expand(mSuccessors[sym]);
+                continue;
+            }
+
+            next[sym] = expand(mStochasticSuccessors[alternatives.first]);
+            for (uint32_t j = 1; j < alternatives.count; j++)
+            {
+                BracketProfile alternative = expand(mStochasticSuccessors[alternatives.first + j]);
+                if (alternative.net != next[sym].net)
+                {
+                    return false;  // where the string continues depends on the choice
+                }
+                next[sym].minDepth = std::min(next[sym].minDepth, alternative.minDepth);
+                next[sym].maxDepth = std::max(next[sym].maxDepth, alternative.maxDepth);
+            }
         }
+        profiles = next;
+    }
+
+    profile = { 0, 0, 0 };
+    for (unsigned char sym : mAxiom)
+    {
+        concatenate(profile, profiles[sym]);
+    }
+    return !mStochastic || profile.balanced();
+}
+
+void LSystem::matchBrackets(const std::string& symbols, size_t maxDepth,
+                            std::vector<BracketMatch>& matches) const
+{
+    matches.clear();
+    std::vector<uint64_t> open;  // indices of the brackets still open
+    open.reserve(maxDepth);
+    for (size_t i = 0; i < symbols.size(); i++)
+    {
+        if (symbols[i] == '[')
+        {
+            open.push_back(matches.size());
+            matches.push_back({ 0, 0, false, true });  // a leaf until a nested bracket draws
+        }
+        else if (symbols[i] == ']')
+        {
+            BracketMatch& match = matches[open.back()];
+            match.close = i;
+            match.nextOpen = matches.size();
+            match.leaf = match.leaf && match.draws;
+            open.pop_back();
+            if (match.draws && !open.empty())
+            {
+                matches[open.back()].draws = true;
+                matches[open.back()].leaf = false;
+            }
+        }
+        else if (!open.empty())
+        {
+            TurtleOp op = mCommands[static_cast<unsigned char>(symbols[i])].op;
+            matches[open.back()].draws |= op == TurtleOp::Draw;
+        }
+    }
+}
+
+void LSystem::loadProgram(const std::string& fileName)
+{
+    std::ifstream file(fileName.c_str());
+    std::string program{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+    file.close();
+    loadProgramFromString(program);
+}
+
+void LSystem::loadProgramFromString(const std::string& program)
+{
+    PreviousDerivation previous;
+    savePreviousDerivation(previous);
+
+    reset();
+    mGrammar = program;
+
+    size_t index = 0;
+    while (index < program.size())
+    {
+        size_t nextIndex = program.find("\n", index);
+        std::string line = program.substr(index, nextIndex - index);
+        addProduction(line);
+        if (nextIndex == std::string::npos)
+        {
+            break;
+        }
+        index = nextIndex + 1;
+    }
+    compileProductions();
+    clearIterations();
+    reuseIterations(previous);
+}
+
+std::string LSystem::getRuleSignature(unsigned char sym) const
+{
+    std::string signature;
+    const Range& alternatives = mAlternatives[sym];
+    for (uint32_t i = alternatives.first; i < alternatives.first + alternatives.count; i++)
+    {
+        const Successor& successor = mStochasticSuccessors[i];
+        signature.append(mSuccessorData, successor.offset, successor.length);
+        signature += '\0';
+        signature += std::to_string(mStochasticThresholds[i]);
+        signature += '\0';
+    }
+    if (alternatives.count == 0 && hasProduction(sym))
+    {
+        signature.assign(mSuccessorData, mSuccessors[sym].offset, mSuccessors[sym].length);
+    }
+    return signature;
+}
+
+void LSystem::savePreviousDerivation(PreviousDerivation& previous)
+{
+    previous.contextFree = !mContextSensitive && !mParametric;
+    previous.stochastic = mStochastic;
+    previous.axiom = mAxiom;
+    previous.symbolNames = mSymbolNames;
+    previous.rules.resize(256);
+    for (unsigned int sym = 0; sym < 256; sym++)
+    {
+        previous.rules[sym] = getRuleSignature(sym);
+    }
+
+    if (previous.contextFree && !previous.stochastic)
+    {
+        computeExpansionLengths(static_cast<unsigned int>(iterations.size()));
+        previous.expansionLengths.swap(mExpansionLengths);
+    }
+    previous.iterations.swap(iterations);
+    previous.lastUse.swap(mLastUse);
+}
+
+void LSystem::reuseIterations(PreviousDerivation& previous)
+{
+    if (previous.iterations.empty() || !previous.contextFree || previous.axiom != mAxiom
+        || previous.symbolNames != mSymbolNames || mContextSensitive || mParametric)
+    {
+        return;
+    }
+
+    // 1. Symbols whose productions changed, and the symbols that can derive one of them
+    bool changed[256];
+    bool affected[256];
+    for (unsigned int sym = 0; sym < 256; sym++)
+    {
+        changed[sym] = affected[sym] = previous.rules[sym] != getRuleSignature(sym);
+    }
+    for (bool grown = true; grown;)
+    {
+        grown = false;
+        for (unsigned int sym = 0; sym < 256; sym++)
+        {
+            if (affected[sym] || !hasProduction(sym))
+            {
+                continue;
+            }
+            // an unchanged symbol has the same successors before and after the edit
+            std::string successors = getRuleSignature(sym);
+            for (unsigned char next : successors)
+            {
+                if (affected[next])
+                {
+                    affected[sym] = grown = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    // 2. Iterations derived without rewriting a changed symbol are still valid
+    unsigned int valid = 0;
+    const std::string* input = &mAxiom;
+    while (valid < previous.iterations.size() && previous.lastUse[valid] != 0
+           && std::none_of(input->begin(), input->end(),
+                           [&](char sym) { return changed[static_cast<unsigned char>(sym)]; }))
+    {
+        input = &previous.iterations[valid];
+        valid++;
+    }
+
+    iterations.resize(previous.iterations.size());
+    mLastUse.resize(previous.iterations.size(), 0);
+    for (unsigned int i = 0; i < valid; i++)
+    {
+        iterations[i].swap(previous.iterations[i]);
+        mLastUse[i] = previous.lastUse[i];
+    }
+
+    // 3. Deeper iterations copy the old expansion of every unaffected symbol of the last valid
+    // input and re-derive only the rest. Stochastic choices depend on positions, which an edit
+    // shifts, so those grammars rebuild on demand instead. The edit may make them longer, so
+    // rebuilding stops at the first one the budget no longer allows, like a fresh derivation.
+    if (previous.stochastic || mStochastic)
+    {
+        return;
+    }
+
+    const std::string& base = valid > 0 ? iterations[valid - 1] : mAxiom;
+    // expansions of the affected symbols in base, rewritten once more for every iteration
+    std::vector<std::string> expansions(256);
+    std::string scratch;
+    for (unsigned char sym : base)
+    {
+        expansions[sym].assign(affected[sym] ? 1 : 0, static_cast<char>(sym));
+    }
+
+    unsigned int end = static_cast<unsigned int>(previous.iterations.size());
+    while (end > valid && previous.lastUse[end - 1] == 0)
+    {
+        end--;
+    }
+    for (unsigned int i = valid; i < end; i++)
+    {
+        unsigned int depth = i - valid + 1;
+        Status limit;
+        uint64_t allowance = getSymbolAllowance(limit);
+        for (std::string& expansion : expansions)
+        {
+            if (!expansion.empty())
+            {
+                if (!iterate(expansion, scratch, depth, allowance))
+                {
+                    return;  // part of the iteration is already too long
+                }
+                expansion.swap(scratch);
+            }
+        }
+        if (previous.lastUse[i] == 0)
+        {
+            continue;
+        }
+
+        const std::string& old = previous.iterations[i];
+        const uint64_t* oldLengths = previous.expansionLengths.data() + depth * 256;
+        uint64_t size = 0;
+        for (unsigned char sym : base)
+        {
+            size += affected[sym] ? expansions[sym].size() : oldLengths[sym];
+        }
+        if (size > allowance)
+        {
+            return;  // this and deeper iterations are derived again when asked for
+        }
+
+        std::string& rebuilt = iterations[i];
+        rebuilt.reserve(size);
+        size_t position = 0;
+        for (unsigned char sym : base)
+        {
+            if (affected[sym])
+            {
+                rebuilt += expansions[sym];
+            }
+            else
+            {
+                rebuilt.append(old, position, oldLengths[sym]);
+            }
+            position += oldLengths[sym];
+        }
+        mLastUse[i] = previous.lastUse[i];
+    }
+}
+
+void LSystem::addProduction(std::string line)
+{
+    size_t index;
+
+    // 1. Strip whitespace, including the '\r' of files with Windows line endings
+    line.erase(std::remove_if(line.begin(), line.end(),
+                              [](char c) { return c == ' ' || c == '\t' || c == '\r'; }),
+               line.end());
+
+    if (line.size() == 0)
+    {
+        return;
+    }
+
+    // bytes from k_FIRST_NAME up are reserved for interned names
+    for (char c : line)
+    {
+        if (static_cast<unsigned char>(c) >= k_FIRST_NAME)
+        {
+            mErrors.push_back("Non-ASCII symbol ignored: " + line);
+            return;
+        }
+    }
+
+    // Symbols skipped by context matching, e.g. "#ignore: +-F"
+    if (line.compare(0, 8, "#ignore:") == 0)
+    {
+        mIgnoreList += line.substr(8);
+        return;
+    }
+
+    // Multi-character symbols that only appear in successors, e.g. "#symbols: leaf,flower"
+    if (line.compare(0, 9, "#symbols:") == 0)
+    {
+        for (size_t start = 9; start < line.size();)
+        {
+            size_t end = line.find(',', start);
+            end = end == std::string::npos ? line.size() : end;
+            if (end - start > 1)
+            {
+                mDeclaredNames.push_back(line.substr(start, end - start));
+            }
+            start = end + 1;
+        }
+        return;
+    }
+
+    // 2. Split productions
+    index = line.find("->");
+    if (index != std::string::npos)
+    {
+        std::string symFrom = line.substr(0, index);
+        Production production{ line.substr(index + 2), 1.0f, false };
+
+        // 3. Stochastic productions carry their probability as "a -(p)-> b"
+        size_t probIndex = symFrom.rfind("-(");
+        if (probIndex != std::string::npos && probIndex > 0 && symFrom.back() == ')')
+        {
+            std::string prob = symFrom.substr(probIndex + 2, symFrom.size() - probIndex - 3);
+            production.probability = strtof(prob.c_str(), nullptr);
+            production.stochastic = true;
+            symFrom = symFrom.substr(0, probIndex);
+        }
+
+        // 4. Parametric predecessors like "A(t):t>0" are compiled separately, in file order
+        if (symFrom.find('(') != std::string::npos)
+        {
+            if (production.stochastic)
+            {
+                mErrors.push_back("Stochastic parametric production ignored: " + line);
+                return;
+            }
+            mParametricProductions.emplace_back(symFrom, production.successor);
+            return;
+        }
+
+        // 5. Context-sensitive predecessors like "a<b>c", "a<b" or "b>c"
+        if (symFrom.size() > 1 && symFrom.find_first_of("<>") != std::string::npos)
+        {
+            if (production.stochastic)
+            {
+                mErrors.push_back("Stochastic context-sensitive production ignored: " + line);
+                return;
+            }
+            mContextProductions.emplace_back(symFrom, production.successor);
+            return;
+        }
+
+        std::vector<Production>& alternatives = productions[symFrom];
+        if (!production.stochastic || (!alternatives.empty() && !alternatives[0].stochastic))
+        {
+            alternatives.clear();  // deterministic productions replace whatever came before
+        }
+        alternatives.push_back(production);
+    }
+    else  // assume its the start sym
+    {
+        mAxiomText = line;
+    }
+}
+
+void LSystem::internName(const std::string& name)
+{
+    if (name.size() < 2 || name.find_first_of(k_NAME_DELIMITERS) != std::string::npos)
+    {
+        return;
+    }
+    for (unsigned char code : mNamesByLength)
+    {
+        if (mSymbolNames[code] == name)
+        {
+            return;
+        }
+    }
+    if (mNamesByLength.size() == 256 - k_FIRST_NAME)
+    {
+        mErrors.push_back("Too many multi-character symbols: " + name);
+        return;
+    }
+
+    unsigned char code = static_cast<unsigned char>(k_FIRST_NAME + mNamesByLength.size());
+    mSymbolNames[code] = name;
+    mNamesByLength.push_back(code);
+}
+
+void LSystem::internSymbols()
+{
+    mSymbolNames.resize(256);
+    for (unsigned int i = 0; i < 256; i++)
+    {
+        mSymbolNames[i] = std::string(1, static_cast<char>(i));
+    }
+    mNamesByLength.clear();
+
+    for (const std::string& name : mDeclaredNames)
+    {
+        internName(name);
+    }
+    for (const auto& command : mRegisteredCommands)
+    {
+        internName(command.first);
+    }
+    for (const auto& [symFrom, alternatives] : productions)
+    {
+        internName(symFrom);
+    }
+    for (const auto& production : mContextProductions)
+    {
+        const std::string& symFrom = production.first;
+        for (size_t start = 0; start <= symFrom.size();)
+        {
+            size_t end = symFrom.find_first_of("<>", start);
+            end = end == std::string::npos ? symFrom.size() : end;
+            internName(symFrom.substr(start, end - start));
+            start = end + 1;
+        }
+    }
+    for (const auto& production : mParametricProductions)
+    {
+        internName(production.first.substr(0, production.first.find('(')));
+    }
+
+    std::stable_sort(mNamesByLength.begin(), mNamesByLength.end(),
+                     [this](unsigned char a, unsigned char b)
+                     { return mSymbolNames[a].size() > mSymbolNames[b].size(); });
+
+    for (bool& ignored : mIgnored)
+    {
+        ignored = false;
+    }
+    for (char sym : tokenize(mIgnoreList))
+    {
+        mIgnored[static_cast<unsigned char>(sym)] = sym != '[' && sym != ']';
+    }
+    mAxiom = tokenize(mAxiomText);
+}
+
+std::string LSystem::tokenize(const std::string& text) const
+{
+    if (mNamesByLength.empty())
+    {
+        return text;
+    }
+
+    // names are only matched outside of parameter lists, which hold expressions
+    std::string symbols;
+    symbols.reserve(text.size());
+    int depth = 0;
+    for (size_t i = 0; i < text.size();)
+    {
+        if (depth == 0)
+        {
+            auto match = std::find_if(mNamesByLength.begin(), mNamesByLength.end(),
+                                      [&](unsigned char code)
+                                      { return text.compare(i, mSymbolNames[code].size(),
+                                                            mSymbolNames[code]) == 0; });
+            if (match != mNamesByLength.end())
+            {
+                symbols += static_cast<char>(*match);
+                i += mSymbolNames[*match].size();
+                continue;
+            }
+        }
+
+        depth += text[i] == '(';
+        depth -= text[i] == ')' && depth > 0;
+        symbols += text[i++];
+    }
+    return symbols;
+}
+
+void LSystem::compileProductions()
+{
+    internSymbols();
+    buildCommands();
+
+    // every byte starts out as its own successor
+    mSuccessorData.resize(256);
+    for (unsigned int i = 0; i < 256; i++)
+    {
+        mSuccessorData[i] = static_cast<char>(i);
+        mSuccessors[i] = { i, 1 };
+        mAlternatives[i] = { 0, 0 };
+    }
+    mStochasticSuccessors.clear();
+    mStochasticThresholds.clear();
+    mStochastic = false;
+
+    auto appendSuccessor = [this](const std::string& symTo)
+    {
+        std::string symbols = tokenize(symTo);
+        Successor successor{ static_cast<uint32_t>(mSuccessorData.size()),
+                             static_cast<uint32_t>(symbols.size()) };
+        mSuccessorData += symbols;
+        return successor;
+    };
+
+    for (const auto& [symFrom, alternatives] : productions)
+    {
+        std::string predecessor = tokenize(symFrom);
+        if (predecessor.size() != 1 || alternatives.empty())
+        {
+            mErrors.push_back("Invalid predecessor: " + symFrom);
+            continue;
+        }
+
+        unsigned char sym = static_cast<unsigned char>(predecessor[0]);
+        if (!alternatives[0].stochastic)
+        {
+            mSuccessors[sym] = appendSuccessor(alternatives[0].successor);
+            continue;
+        }
+
+        // normalize the probabilities into cumulative thresholds
+        float total = 0.0f;
+        for (const Production& production : alternatives)
+        {
+            total += production.probability;
+        }
+
+        mAlternatives[sym] = { static_cast<uint32_t>(mStochasticSuccessors.size()),
+                               static_cast<uint32_t>(alternatives.size()) };
+        float threshold = 0.0f;
+        for (const Production& production : alternatives)
+        {
+            threshold += total > 0.0f ? production.probability / total : 1.0f / alternatives.size();
+            mStochasticSuccessors.push_back(appendSuccessor(production.successor));
+            mStochasticThresholds.push_back(threshold);
+        }
+        mStochasticThresholds.back() = 1.0f;  // guard against rounding leaving a gap at the top
+
+        mSuccessors[sym] = mStochasticSuccessors[mAlternatives[sym].first];
+        mStochastic = true;
+    }
+    mExpansionLengths.clear();
+    mGeneration++;
+
+    // Context rules, grouped by predecessor with file order kept inside a group
+    mContextRules.clear();
+    for (unsigned int i = 0; i < 256; i++)
+    {
+        mContextRanges[i] = { 0, 0 };
+    }
+
+    std::vector<std::pair<unsigned char, ContextRule>> contextRules;
+    for (const auto& production : mContextProductions)
+    {
+        const std::string symFrom = tokenize(production.first);
+        const std::string& symTo = production.second;
+        size_t leftIndex = symFrom.find('<');
+        size_t rightIndex = symFrom.find('>', leftIndex == std::string::npos ? 0 : leftIndex);
+        size_t predStart = leftIndex == std::string::npos ? 0 : leftIndex + 1;
+        size_t predEnd = rightIndex == std::string::npos ? symFrom.size() : rightIndex;
+        size_t rightLength = rightIndex == std::string::npos ? 0 : symFrom.size() - rightIndex - 1;
+        if (predEnd - predStart != 1 || (leftIndex != std::string::npos && leftIndex != 1)
+            || (rightIndex != std::string::npos && rightLength != 1))
+        {
+            mErrors.push_back("Only single-symbol contexts are supported: " + production.first);
+            continue;
+        }
+
+        ContextRule rule;
+        rule.left = leftIndex == std::string::npos ? 0 : static_cast<unsigned char>(symFrom[0]);
+        rule.right = rightIndex == std::string::npos ? 0 : static_cast<unsigned char>(symFrom.back());
+        rule.successor = appendSuccessor(symTo);
+        contextRules.emplace_back(static_cast<unsigned char>(symFrom[predStart]), rule);
+    }
+
+    std::stable_sort(contextRules.begin(), contextRules.end(),
+                     [](const auto& a, const auto& b) { return a.first < b.first; });
+    for (const auto& [sym, rule] : contextRules)
+    {
+        if (mContextRanges[sym].count == 0)
+        {
+            mContextRanges[sym].first = static_cast<uint32_t>(mContextRules.size());
+        }
+        mContextRanges[sym].count++;
+        mContextRules.push_back(rule);
+    }
+    mContextSensitive = !mContextRules.empty();
+
+    compileParametricProductions();
+}
+
+// Splits "F(a,b)[+A(t*2)]" into its modules: each symbol with the text of its arguments
+static bool splitModules(const std::string& text,
+                         std::vector<std::pair<char, std::vector<std::string>>>& modules)
+{
+    modules.clear();
+    size_t i = 0;
+    while (i < text.size())
+    {
+        modules.emplace_back(text[i++], std::vector<std::string>());
+        if (i >= text.size() || text[i] != '(')
+        {
+            continue;
+        }
+
+        std::vector<std::string>& args = modules.back().second;
+        size_t argStart = ++i;
+        int depth = 1;
+        for (; i < text.size() && depth > 0; i++)
+        {
+            if (text[i] == '(')
+            {
+                depth++;
+            }
+            else if (text[i] == ')' || (text[i] == ',' && depth == 1))
+            {
+                depth -= text[i] == ')';
+                if (depth <= 1)
+                {
+                    args.push_back(text.substr(argStart, i - argStart));
+                    argStart = i + 1;
+                }
+            }
+        }
+        if (depth != 0)
+        {
+            return false;  // unbalanced parentheses
+        }
+    }
+    return true;
+}
+
+bool LSystem::compileParametricRule(const std::string& symFrom, const std::string& symTo,
+                                    bool plain, unsigned char& sym, ParametricRule& rule)
+{
+    std::vector<std::pair<char, std::vector<std::string>>> modules;
+    std::string error;
+
+    // 1. Predecessor module and its formal parameters, then the optional condition
+    size_t conditionIndex = symFrom.find(':');
+    if (!splitModules(tokenize(symFrom.substr(0, conditionIndex)), modules) || modules.size() != 1)
+    {
+        mErrors.push_back("Invalid predecessor: " + symFrom);
+        return false;
+    }
+
+    sym = static_cast<unsigned char>(modules[0].first);
+    std::vector<std::string> formals = modules[0].second;
+    rule.numFormals = plain ? -1 : static_cast<int32_t>(formals.size());
+    rule.condition = { 0, 0 };
+    if (conditionIndex != std::string::npos
+        && !mExpressions.compile(symFrom.substr(conditionIndex + 1), formals, rule.condition, error))
+    {
+        mErrors.push_back(error);
+        return false;
+    }
+
+    // 2. Successor modules, whose arguments are expressions over the formals
+    if (!splitModules(tokenize(symTo), modules))
+    {
+        mErrors.push_back("Invalid successor: " + symTo);
+        return false;
+    }
+
+    for (const auto& [symbol, args] : modules)
+    {
+        rule.successor += symbol;
+        rule.argCounts.push_back(static_cast<uint32_t>(args.size()));
+        for (const std::string& arg : args)
+        {
+            ExpressionProgram::Expression expression;
+            if (!mExpressions.compile(arg, formals, expression, error))
+            {
+                mErrors.push_back(error);
+                return false;
+            }
+            rule.args.push_back(expression);
+        }
+    }
+    return true;
+}
+
+void LSystem::compileParametricProductions()
+{
+    mExpressions.clear();
+    mParametricRules.clear();
+    for (unsigned int i = 0; i < 256; i++)
+    {
+        mRuleRanges[i] = { 0, 0 };
+    }
+
+    mParametric = !mParametricProductions.empty() || mAxiom.find('(') != std::string::npos;
+    if (!mParametric)
+    {
+        return;
+    }
+
+    // Parametric rules first, in file order, with plain productions as the fallback of a symbol
+    std::vector<std::pair<unsigned char, ParametricRule>> rules;
+    auto addRule = [&](const std::string& symFrom, const std::string& symTo, bool plain)
+    {
+        std::pair<unsigned char, ParametricRule> rule;
+        if (compileParametricRule(symFrom, symTo, plain, rule.first, rule.second))
+        {
+            rules.push_back(std::move(rule));
+        }
+    };
+
+    for (const auto& [symFrom, symTo] : mParametricProductions)
+    {
+        addRule(symFrom, symTo, false);
+    }
+    for (const auto& [symFrom, alternatives] : productions)
+    {
+        addRule(symFrom, alternatives[0].successor, true);
+    }
+
+    std::stable_sort(rules.begin(), rules.end(),
+                     [](const auto& a, const auto& b) { return a.first < b.first; });
+    for (auto& [sym, rule] : rules)
+    {
+        if (mRuleRanges[sym].count == 0)
+        {
+            mRuleRanges[sym].first = static_cast<uint32_t>(mParametricRules.size());
+
+            // without a plain production, the first rule's symbols stand in for the symbol-level
+            // analysis, such as growth predictions
+            if (!hasProduction(sym))
+            {
+                mSuccessors[sym] = { static_cast<uint32_t>(mSuccessorData.size()),
+                                     static_cast<uint32_t>(rule.successor.size()) };
+                mSuccessorData += rule.successor;
+            }
+        }
+        mRuleRanges[sym].count++;
+        mParametricRules.push_back(std::move(rule));
+    }
+
+    // The axiom's arguments are constant expressions
+    std::vector<std::pair<char, std::vector<std::string>>> modules;
+    mAxiomModules.clear();
+    if (!splitModules(mAxiom, modules))
+    {
+        mErrors.push_back("Invalid axiom: " + mAxiom);
+        return;
+    }
+
+    std::string error;
+    std::vector<float> values;
+    for (const auto& [symbol, args] : modules)
+    {
+        values.clear();
+        for (const std::string& arg : args)
+        {
+            ExpressionProgram::Expression expression;
+            if (!mExpressions.compile(arg, {}, expression, error))
+            {
+                mErrors.push_back(error);
+            }
+            values.push_back(mExpressions.evaluate(expression, nullptr));
+        }
+        mAxiomModules.append(symbol, values.data(), static_cast<uint32_t>(values.size()));
+    }
+    mModules = mAxiomModules;
+    mModulesIteration = -1;
+}
+
+void LSystem::ModuleString::clear()
+{
+    symbols.clear();
+    params.clear();
+    paramOffsets.assign(1, 0);
+}
+
+void LSystem::ModuleString::append(char sym, const float* values, uint32_t count)
+{
+    symbols.push_back(sym);
+    params.insert(params.end(), values, values + count);
+    paramOffsets.push_back(static_cast<uint32_t>(params.size()));
+}
+
+const LSystem::ModuleString& LSystem::getModules(unsigned int n)
+{
+    mLastResult = { Status::Ok, static_cast<int>(n) };
+    if (mModulesIteration > static_cast<int>(n))
+    {
+        mModules = mAxiomModules;
+        mModulesIteration = -1;
+    }
+
+    for (unsigned int i = mModulesIteration + 1; i <= n; i++)
+    {
+        Status limit;
+        if (!iterateParametric(mModules, mModulesScratch, limit))
+        {
+            mLastResult = { limit, static_cast<int>(i) - 1 };
+            break;
+        }
+        mModules.symbols.swap(mModulesScratch.symbols);
+        mModules.paramOffsets.swap(mModulesScratch.paramOffsets);
+        mModules.params.swap(mModulesScratch.params);
+        mModulesIteration = i;
+    }
+    return mModules;
+}
+
+const LSystem::ParametricRule* LSystem::findParametricRule(unsigned char sym, const float* params,
+                                                          uint32_t count) const
+{
+    const Range& range = mRuleRanges[sym];
+    for (uint32_t i = range.first; i < range.first + range.count; i++)
+    {
+        const ParametricRule& rule = mParametricRules[i];
+        if (rule.numFormals >= 0 && static_cast<uint32_t>(rule.numFormals) != count)
+        {
+            continue;
+        }
+        if (rule.condition.length != 0 && mExpressions.evaluate(rule.condition, params) == 0.0f)
+        {
+            continue;
+        }
+        return &rule;
+    }
+    return nullptr;
+}
+
+bool LSystem::iterateParametric(const ModuleString& input, ModuleString& output,
+                                Status& limit) const
+{
+    // 1. Measure the rewrite, so one over budget is refused before anything is allocated
+    uint64_t symbols = 0;
+    uint64_t params = 0;
+    for (size_t i = 0; i < input.symbols.size(); i++)
+    {
+        unsigned char sym = static_cast<unsigned char>(input.symbols[i]);
+        const float* values = input.params.data() + input.paramOffsets[i];
+        uint32_t count = input.paramOffsets[i + 1] - input.paramOffsets[i];
+        const ParametricRule* rule = findParametricRule(sym, values, count);
+        symbols += rule ? rule->successor.size() : 1;
+        params += rule ? rule->args.size() : count;
+    }
+    uint64_t bytes = symbols + (symbols + 1) * sizeof(uint32_t) + params * sizeof(float);
+    if (mBudget.maxSymbols > 0 && symbols > mBudget.maxSymbols)
+    {
+        limit = Status::SymbolLimit;
+        return false;
+    }
+    if (mBudget.maxBytes > 0 && bytes > mBudget.maxBytes)
+    {
+        limit = Status::MemoryLimit;
+        return false;
+    }
+
+    // 2. Rewrite into buffers sized for it
+    output.clear();
+    output.symbols.reserve(symbols);
+    output.paramOffsets.reserve(symbols + 1);
+    output.params.reserve(params);
+    for (size_t i = 0; i < input.symbols.size(); i++)
+    {
+        char sym = input.symbols[i];
+        const float* params = input.params.data() + input.paramOffsets[i];
+        uint32_t count = input.paramOffsets[i + 1] - input.paramOffsets[i];
+
+        const ParametricRule* rule = findParametricRule(static_cast<unsigned char>(sym), params,
+                                                        count);
+        if (rule == nullptr)
+        {
+            output.append(sym, params, count);
+            continue;
+        }
+
+        // Evaluate every argument straight into the output's parameter buffer
+        const ExpressionProgram::Expression* arg = rule->args.data();
+        for (size_t j = 0; j < rule->successor.size(); j++)
+        {
+            output.symbols.push_back(rule->successor[j]);
+            for (uint32_t k = 0; k < rule->argCounts[j]; k++)
+            {
+                output.params.push_back(mExpressions.evaluate(*arg++, params));
+            }
+            output.paramOffsets.push_back(static_cast<uint32_t>(output.params.size()));
+        }
+    }
+    return true;
+}
+
+void LSystem::formatModules(const ModuleString& modules, std::string& text) const
+{
+    text.clear();
+    char buffer[32];
+    for (size_t i = 0; i < modules.symbols.size(); i++)
+    {
+        text += modules.symbols[i];
+        for (uint32_t j = modules.paramOffsets[i]; j < modules.paramOffsets[i + 1]; j++)
+        {
+            snprintf(buffer, sizeof(buffer), "%g", modules.params[j]);
+            text += j == modules.paramOffsets[i] ? "(" : ",";
+            text += buffer;
+        }
+        if (modules.paramOffsets[i + 1] != modules.paramOffsets[i])
+        {
+            text += ")";
+        }
+    }
+}
+
+bool LSystem::hasProduction(unsigned char sym) const
+{
+    return mSuccessors[sym].offset >= 256;  // the first 256 bytes hold the identity successors
+}
+
+// Counter-based random number in [0, 1): a stateless hash of its inputs (SplitMix64 finalizer)
+static float randomSample(uint32_t seed, unsigned int iteration, uint64_t position)
+{
+    uint64_t x = position ^ (static_cast<uint64_t>(seed) << 32 | iteration) * 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    x = x ^ (x >> 31);
+    return static_cast<float>(x >> 40) / static_cast<float>(1 << 24);
+}
+
+const LSystem::Successor& LSystem::getSuccessor(unsigned char sym, unsigned int iteration,
+                                                uint64_t position) const
+{
+    const Range& alternatives = mAlternatives[sym];
+    if (alternatives.count == 0)
+    {
+        return mSuccessors[sym];
+    }
+
+    float sample = randomSample(mSeed, iteration, position);
+    uint32_t last = alternatives.first + alternatives.count - 1;
+    uint32_t i = alternatives.first;
+    while (i < last && sample >= mStochasticThresholds[i])
+    {
+        i++;
+    }
+    return mStochasticSuccessors[i];
+}
+
+const LSystem::Successor& LSystem::selectSuccessor(unsigned char sym, unsigned int iteration,
+                                                   uint64_t position) const
+{
+    const Range& range = mContextRanges[sym];
+    for (uint32_t i = range.first; i < range.first + range.count; i++)
+    {
+        const ContextRule& rule = mContextRules[i];
+        if ((rule.left == 0 || rule.left == static_cast<unsigned char>(mLeftContext[position]))
+            && (rule.right == 0 || rule.right == static_cast<unsigned char>(mRightContext[position])))
+        {
+            return rule.successor;
+        }
+    }
+    return getSuccessor(sym, iteration, position);
+}
+
+void LSystem::computeContexts(const std::string& input) const
+{
+    mLeftContext.resize(input.size());
+    mRightContext.resize(input.size());
+    std::string saved;  // context of each enclosing level while inside a branch
+
+    // Left context: the previous symbol on this level, or the one before the enclosing branch
+    char last = 0;
+    for (size_t i = 0; i < input.size(); i++)
+    {
+        char sym = input[i];
+        mLeftContext[i] = last;
+        if (sym == '[')
+        {
+            saved.push_back(last);
+        }
+        else if (sym == ']')
+        {
+            last = saved.empty() ? 0 : saved.back();
+            if (!saved.empty())
+            {
+                saved.pop_back();
+            }
+        }
+        else if (!mIgnored[static_cast<unsigned char>(sym)])
+        {
+            last = sym;
+        }
+    }
+
+    // Right context: the next symbol on this level, skipping over whole branches
+    saved.clear();
+    char next = 0;
+    for (size_t i = input.size(); i-- > 0;)
+    {
+        char sym = input[i];
+        mRightContext[i] = next;
+        if (sym == ']')
+        {
+            saved.push_back(next);
+            next = 0;  // the last symbol of a branch has nothing to its right
+        }
+        else if (sym == '[')
+        {
+            next = saved.empty() ? 0 : saved.back();
+            if (!saved.empty())
+            {
+                saved.pop_back();
+            }
+        }
+        else if (!mIgnored[static_cast<unsigned char>(sym)])
+        {
+            next = sym;
+        }
+    }
+}
+
+size_t LSystem::countSuccessors(const char* begin, const char* end, unsigned int iteration,
+                                uint64_t position) const
+{
+    size_t size = 0;
+    for (const char* sym = begin; sym != end; sym++, position++)
+    {
+        size += selectSuccessor(static_cast<unsigned char>(*sym), iteration, position).length;
+    }
+    return size;
+}
+
+void LSystem::writeSuccessors(const char* begin, const char* end, char* out,
+                              unsigned int iteration, uint64_t position) const
+{
+    const char* data = mSuccessorData.data();
+    for (const char* sym = begin; sym != end; sym++, position++)
+    {
+        const Successor& successor = selectSuccessor(static_cast<unsigned char>(*sym), iteration,
+                                                     position);
+        memcpy(out, data + successor.offset, successor.length);
+        out += successor.length;
+    }
+}
+
+bool LSystem::iterate(const std::string& input, std::string& output, unsigned int iteration,
+                      uint64_t maxSymbols) const
+{
+    if (mContextSensitive)
+    {
+        computeContexts(input);  // read-only from here on, so chunks can share it
+    }
+
+    if (mThreadCount > 1 && input.size() >= k_PARALLEL_MIN_SYMBOLS)
+    {
+        return iterateParallel(input, output, iteration, maxSymbols);
+    }
+
+    // 1. Size the output exactly so the fill below never reallocates, or refuse before allocating
+    const char* begin = input.data();
+    const char* end = begin + input.size();
+    size_t size = countSuccessors(begin, end, iteration, 0);
+    if (size > maxSymbols)
+    {
+        return false;
+    }
+    output.resize(size);
+
+    // 2. Copy each successor straight into place
+    writeSuccessors(begin, end, output.data(), iteration, 0);
+    return true;
+}
+
+bool LSystem::iterateParallel(const std::string& input, std::string& output,
+                              unsigned int iteration, uint64_t maxSymbols) const
+{
+    size_t numChunks = mThreadCount;
+    size_t chunkSize = (input.size() + numChunks - 1) / numChunks;
+    const char* data = input.data();
+
+    auto chunkStart = [&](size_t chunk)
+    {
+        size_t index = chunk * chunkSize;
+        return index < input.size() ? index : input.size();
+    };
+
+    // 1. Count the output length of every chunk
+    std::vector<size_t> offsets(numChunks + 1, 0);
+    parallelFor(numChunks, mThreadCount, [&](size_t chunk)
+                {
+                    size_t start = chunkStart(chunk);
+                    offsets[chunk + 1] = countSuccessors(data + start, data + chunkStart(chunk + 1),
+                                                         iteration, start);
+                });
+
+    // 2. Exclusive prefix sum turns the lengths into output offsets
+    for (size_t chunk = 0; chunk < numChunks; chunk++)
+    {
+        offsets[chunk + 1] += offsets[chunk];
+    }
+    if (offsets[numChunks] > maxSymbols)
+    {
+        return false;
+    }
+    output.resize(offsets[numChunks]);
+
+    // 3. Every chunk writes its successors straight to their final position
+    char* out = output.data();
+    parallelFor(numChunks, mThreadCount, [&](size_t chunk)
+                {
+                    size_t start = chunkStart(chunk);
+                    writeSuccessors(data + start, data + chunkStart(chunk + 1),
+                                    out + offsets[chunk], iteration, start);
+                });
+    return true;
+}
+
+LSystem::DerivationStream::DerivationStream(const LSystem& system, unsigned int n)
+    : mSystem(system), mTarget(n + 1)  // iteration 0 is the axiom rewritten once
+{
+    mStack.reserve(mTarget + 1);
+    mPositions.resize(mTarget + 1, 0);
+    if (mSystem.mContextSensitive || mSystem.mParametric)
+    {
+        return;  // nothing to stream, rather than a wrong string
+    }
+    const std::string& axiom = mSystem.mAxiom;
+    mStack.push_back({ axiom.data(), axiom.data() + axiom.size() });
+}
+
+bool LSystem::DerivationStream::next(char& sym)
+{
+    while (!mStack.empty())
+    {
+        Frame& top = mStack.back();
+        if (top.pos == top.end)
+        {
+            mStack.pop_back();
+            continue;
+        }
+
+        size_t level = mStack.size() - 1;
+        sym = *top.pos++;
+        uint64_t position = mPositions[level]++;
+
+        // Symbols without a production expand to themselves at every depth. Stochastic grammars
+        // still walk them down level by level so the positions stay exact on every level.
+        unsigned char index = static_cast<unsigned char>(sym);
+        if (level == mTarget || (!mSystem.mStochastic && !mSystem.hasProduction(index)))
+        {
+            return true;
+        }
+
+        const Successor& successor = mSystem.getSuccessor(index, level, position);
+        const char* data = mSystem.mSuccessorData.data() + successor.offset;
+        mStack.push_back({ data, data + successor.length });
+    }
+    return false;
+}
+
+LSystem::CompressedIteration LSystem::getCompressedIteration(unsigned int n)
+{
+    computeExpansionLengths(n + 1);
+    return CompressedIteration(*this, n);
+}
+
+void LSystem::computeExpansionLengths(unsigned int depth)
+{
+    size_t computed = mExpansionLengths.size() / 256;
+    if (computed > depth)
+    {
+        return;
+    }
+
+    mExpansionLengths.resize((depth + 1) * 256);
+    for (size_t d = computed; d <= depth; d++)
+    {
+        uint64_t* lengths = mExpansionLengths.data() + d * 256;
+        const uint64_t* previous = lengths - 256;
+        for (unsigned int sym = 0; sym < 256; sym++)
+        {
+            if (d == 0 || !hasProduction(sym))
+            {
+                lengths[sym] = 1;
+                continue;
+            }
+
+            const Successor& successor = mSuccessors[sym];
+            uint64_t length = 0;
+            for (uint32_t i = 0; i < successor.length; i++)
+            {
+                unsigned char next = static_cast<unsigned char>(mSuccessorData[successor.offset + i]);
+                length = saturatingAdd(length, previous[next]);
+            }
+            lengths[sym] = length;
+        }
+    }
+}
+
+uint64_t LSystem::getExpansionLength(unsigned char sym, unsigned int depth) const
+{
+    return mExpansionLengths[depth * 256 + sym];
+}
+
+LSystem::CompressedIteration::CompressedIteration(const LSystem& system, unsigned int n)
+    : mSystem(system), mIteration(n), mGeneration(system.mGeneration)
+{}
+
+bool LSystem::CompressedIteration::valid() const
+{
+    return mGeneration == mSystem.mGeneration && !mSystem.mStochastic
+           && !mSystem.mContextSensitive && !mSystem.mParametric;
+}
+
+uint64_t LSystem::CompressedIteration::length() const
+{
+    uint64_t length = 0;
+    if (!valid())
+    {
+        return 0;
+    }
+    for (unsigned char sym : mSystem.mAxiom)
+    {
+        length = saturatingAdd(length, mSystem.getExpansionLength(sym, mIteration + 1));
+    }
+    return length;
+}
+
+char LSystem::CompressedIteration::operator[](uint64_t index) const
+{
+    if (!valid())
+    {
+        return '\0';
+    }
+
+    // Descend one (symbol, depth) node per level, skipping whole expansions by their length
+    const char* sym = mSystem.mAxiom.data();
+    const char* end = sym + mSystem.mAxiom.size();
+    unsigned int depth = mIteration + 1;
+    while (sym != end)
+    {
+        unsigned char c = static_cast<unsigned char>(*sym);
+        uint64_t length = mSystem.getExpansionLength(c, depth);
+        if (index >= length)
+        {
+            index -= length;
+            sym++;
+            continue;
+        }
+        if (depth == 0 || !mSystem.hasProduction(c))
+        {
+            return *sym;
+        }
+
+        const Successor& successor = mSystem.mSuccessors[c];
+        sym = mSystem.mSuccessorData.data() + successor.offset;
+        end = sym + successor.length;
+        depth--;
+    }
+    return '\0';  // out of range
+}
+
+LSystem::DerivationStream LSystem::CompressedIteration::stream() const
+{
+    return DerivationStream(mSystem, mIteration);
+}
+
+LSystem::Turtle::Turtle() : pos(0, 0, 0), up(0, 0, 1), forward(1, 0, 0), left(0, 1, 0) {}
+
+LSystem::Turtle::Turtle(const LSystem::Turtle& t)
+{
+    pos = t.pos;
+    up = t.up;
+    forward = t.forward;
+    left = t.left;
+}
+
+LSystem::Turtle& LSystem::Turtle::operator=(const LSystem::Turtle& t)
+{
+    if (&t == this)
+    {
+        return *this;
+    }
+
+    pos = t.pos;
+    up = t.up;
+    forward = t.forward;
+    left = t.left;
+    return *this;
+}
+
+void LSystem::Turtle::moveForward(float length)
+{
+    pos = pos + length * forward;
+}
+
+LSystem::TurtleStack::TurtleStack(size_t capacity) : mStates(capacity), mSize(0) {}
+
+void LSystem::TurtleStack::push(const Turtle& turtle)
+{
+    mStates[mSize++] = turtle;
+}
+
+const LSystem::Turtle& LSystem::TurtleStack::pop()
+{
+    return mStates[--mSize];
+}
+
+size_t LSystem::TurtleStack::size() const
+{
+    return mSize;
+}
+
+LSystem::Rotation::Rotation(double degrees)
+    : c(cos(Deg2Rad * degrees)), s(sin(Deg2Rad * degrees))
+{}
+
+LSystem::Transform LSystem::Turtle::getFrame() const
+{
+    return { pos, forward, left, up };
+}
+
+void LSystem::Turtle::setFrame(const Transform& frame)
+{
+    pos = frame.pos;
+    forward = frame.forward;
+    left = frame.left;
+    up = frame.up;
+}
+
+// Each rotation turns two axes of the frame within their plane and leaves the third alone
+void LSystem::Turtle::applyUpRot(const Rotation& rotation)
+{
+    vec3 f = forward;
+    forward = rotation.c * f + rotation.s * left;
+    left = rotation.c * left - rotation.s * f;
+}
+
+void LSystem::Turtle::applyLeftRot(const Rotation& rotation)
+{
+    vec3 f = forward;
+    forward = rotation.c * f - rotation.s * up;
+    up = rotation.s * f + rotation.c * up;
+}
+
+void LSystem::Turtle::applyForwardRot(const Rotation& rotation)
+{
+    vec3 l = left;
+    left = rotation.c * l + rotation.s * up;
+    up = rotation.c * up - rotation.s * l;
+}
+
+// Where interpret() puts what the turtle draws
+namespace
+{
+struct VectorSink
+{
+    std::vector<LSystem::Branch>& branches;
+    std::vector<LSystem::Geometry>* models;  // null when nobody wants them
+
+    size_t branchCount() const { return branches.size(); }
+    bool wantsModels() const { return models != nullptr; }
+    bool wantsBrackets() const { return false; }
+    void reserve(uint64_t numBranches, uint64_t numModels)
+    {
+        branches.reserve(branches.size() + numBranches);
+        if (models)
+        {
+            models->reserve(models->size() + numModels);
+        }
+    }
+    void truncate(size_t count) { branches.resize(count); }
+    void addBranch(const vec3& start, const vec3& end, size_t) { branches.emplace_back(start, end); }
+    void addModel(const vec3& pos, const std::string& name)
+    {
+        if (models)
+        {
+            models->emplace_back(pos, name);
+        }
+    }
+    void addBracket(const vec3&, size_t, bool) {}
+};
+
+struct BufferSink
+{
+    LSystem::BranchBuffers& buffers;
+    bool withDepth;
+
+    size_t branchCount() const { return buffers.size(); }
+    bool wantsModels() const { return false; }
+    bool wantsBrackets() const { return false; }
+    void reserve(uint64_t numBranches, uint64_t)
+    {
+        buffers.reserve(buffers.size() + numBranches, withDepth);
+    }
+    void truncate(size_t count) { buffers.resize(count); }
+    void addBranch(const vec3& start, const vec3& end, size_t depth)
+    {
+        buffers.push_back(start, end);
+        if (withDepth)
+        {
+            buffers.depth.push_back(static_cast<uint16_t>(depth < UINT16_MAX ? depth : UINT16_MAX));
+        }
+    }
+    void addModel(const vec3&, const std::string&) {}
+    void addBracket(const vec3&, size_t, bool) {}
+};
+
+// Batches for a GeometrySink. Everything pending is handed over whenever one batch fills, and
+// branches past the budget are counted but never handed over, since they can't be taken back.
+struct CallbackSink
+{
+    static constexpr size_t k_BATCH = 4096;
+
+    CallbackSink(LSystem::GeometrySink& target, size_t maxBranches)
+        : target(target)
+        , maxBranches(maxBranches)
+        , keepModels(target.wantsModels())
+        , keepBrackets(target.wantsBrackets())
+        , count(0)
+    {
+        branches.reserve(k_BATCH);
+        depths.reserve(k_BATCH);
+    }
+
+    LSystem::GeometrySink& target;
+    size_t maxBranches;
+    bool keepModels;
+    bool keepBrackets;
+    size_t count;  // branches drawn so far
+    std::vector<LSystem::Branch> branches;
+    std::vector<uint32_t> depths;
+    std::vector<LSystem::Geometry> models;
+    std::vector<LSystem::GeometrySink::Bracket> brackets;
+
+    size_t branchCount() const { return count; }
+    bool wantsModels() const { return keepModels; }
+    bool wantsBrackets() const { return keepBrackets; }
+    void reserve(uint64_t, uint64_t) {}
+    void truncate(size_t newCount) { count = newCount; }
+    void addBranch(const vec3& start, const vec3& end, size_t depth)
+    {
+        if (count++ >= maxBranches)
+        {
+            return;
+        }
+        if (branches.size() == k_BATCH)
+        {
+            flush();
+        }
+        branches.emplace_back(start, end);
+        depths.push_back(static_cast<uint32_t>(std::min<size_t>(depth, UINT32_MAX)));
+    }
+    void addModel(const vec3& pos, const std::string& name)
+    {
+        if (!keepModels)
+        {
+            return;
+        }
+        if (models.size() == k_BATCH)
+        {
+            flush();
+        }
+        models.emplace_back(pos, name);
+    }
+    void addBracket(const vec3& pos, size_t depth, bool push)
+    {
+        if (!keepBrackets)
+        {
+            return;
+        }
+        if (brackets.size() == k_BATCH)
+        {
+            flush();
+        }
+        brackets.push_back({ pos, static_cast<uint32_t>(depth), push, count });
+    }
+    void flush()
+    {
+        if (!branches.empty())
+        {
+            target.onBranches(branches.data(), depths.data(), branches.size());
+        }
+        if (!models.empty())
+        {
+            target.onModels(models.data(), models.size());
+        }
+        if (!brackets.empty())
+        {
+            target.onBrackets(brackets.data(), brackets.size());
+        }
+        branches.clear();
+        depths.clear();
+        models.clear();
+        brackets.clear();
+    }
+};
+
+struct NullSink
+{
+    size_t branchCount() const { return 0; }
+    void reserve(uint64_t, uint64_t) {}
+    void truncate(size_t) {}
+    void addBranch(const vec3&, const vec3&, size_t) {}
+    void addModel(const vec3&, const std::string&) {}
+    void addBracket(const vec3&, size_t, bool) {}
+};
+
+// Output of one chunk of a parallel interpretation, replayed into the real sink in chunk order.
+// Models and brackets are only kept when that sink wants them; a bracket's branch counts the
+// chunk's own branches.
+struct ChunkSink
+{
+    bool keepModels;
+    bool keepBrackets;
+    std::vector<LSystem::Branch> branches;
+    std::vector<size_t> depths;
+    std::vector<LSystem::Geometry> models;
+    std::vector<LSystem::GeometrySink::Bracket> brackets;
+
+    size_t branchCount() const { return branches.size(); }
+    void reserve(uint64_t, uint64_t) {}
+    void truncate(size_t) {}
+    void addBranch(const vec3& start, const vec3& end, size_t depth)
+    {
+        branches.emplace_back(start, end);
+        depths.push_back(depth);
+    }
+    void addModel(const vec3& pos, const std::string& name)
+    {
+        if (keepModels)
+        {
+            models.emplace_back(pos, name);
+        }
+    }
+    void addBracket(const vec3& pos, size_t depth, bool push)
+    {
+        if (keepBrackets)
+        {
+            brackets.push_back({ pos, static_cast<uint32_t>(depth), push, branches.size() });
+        }
+    }
+};
+}  // namespace
+
+void LSystem::BranchBuffers::clear()
+{
+    resize(0);
+    depth.clear();
+}
+
+void LSystem::BranchBuffers::reserve(size_t count, bool withDepth)
+{
+    for (std::vector<float>* coordinate : { &startX, &startY, &startZ, &endX, &endY, &endZ })
+    {
+        coordinate->reserve(count);
+    }
+    if (withDepth)
+    {
+        depth.reserve(count);
+    }
+}
+
+void LSystem::BranchBuffers::resize(size_t count)
+{
+    for (std::vector<float>* coordinate : { &startX, &startY, &startZ, &endX, &endY, &endZ })
+    {
+        coordinate->resize(count);
+    }
+    if (depth.size() > count)
+    {
+        depth.resize(count);
+    }
+}
+
+void LSystem::BranchBuffers::push_back(const vec3& start, const vec3& end)
+{
+    startX.push_back(static_cast<float>(start[0]));
+    startY.push_back(static_cast<float>(start[1]));
+    startZ.push_back(static_cast<float>(start[2]));
+    endX.push_back(static_cast<float>(end[0]));
+    endY.push_back(static_cast<float>(end[1]));
+    endZ.push_back(static_cast<float>(end[2]));
+}
+
+// Bits of a point, with -0 folded into 0, so only exactly coincident points compare equal
+namespace
+{
+struct PointKey
+{
+    uint32_t x, y, z;
+
+    bool operator==(const PointKey& other) const
+    {
+        return x == other.x && y == other.y && z == other.z;
+    }
+};
+
+struct PointKeyHash
+{
+    size_t operator()(const PointKey& key) const
+    {
+        uint64_t h = key.x * 0x9E3779B97F4A7C15ull;
+        h = (h ^ (h >> 29) ^ key.y) * 0xBF58476D1CE4E5B9ull;
+        h = (h ^ (h >> 32) ^ key.z) * 0x94D049BB133111EBull;
+        return static_cast<size_t>(h ^ (h >> 31));
+    }
+};
+
+PointKey pointKey(float x, float y, float z)
+{
+    PointKey key;
+    x += 0.0f;
+    y += 0.0f;
+    z += 0.0f;
+    memcpy(&key.x, &x, sizeof(float));
+    memcpy(&key.y, &y, sizeof(float));
+    memcpy(&key.z, &z, sizeof(float));
+    return key;
+}
+}  // namespace
+
+void LSystem::BranchBuffers::findChains(std::vector<size_t>& chains) const
+{
+    size_t count = size();
+    std::unordered_map<PointKey, uint32_t, PointKeyHash> starts(count);
+    for (size_t b = 0; b < count; b++)
+    {
+        starts[pointKey(startX[b], startY[b], startZ[b])]++;
+    }
+
+    // The turtle draws an unbranched run in order, so a chain continues into the next branch when
+    // that starts where this one ends and nothing else starts there too
+    chains.clear();
+    for (size_t b = 0; b < count; b++)
+    {
+        if (b == 0 || startX[b] != endX[b - 1] || startY[b] != endY[b - 1]
+            || startZ[b] != endZ[b - 1] || starts[pointKey(startX[b], startY[b], startZ[b])] > 1)
+        {
+            chains.push_back(b);
+        }
+    }
+    chains.push_back(count);
+}
+
+void LSystem::BranchBuffers::mergeCollinear(float maxDegrees, BranchBuffers& merged,
+                                            std::vector<size_t>* sources) const
+{
+    std::vector<size_t> chains;
+    findChains(chains);
+
+    auto direction = [this](size_t b)
+    {
+        vec3 d(endX[b] - startX[b], endY[b] - startY[b], endZ[b] - startZ[b]);
+        return d.Length() > 0.0 ? d / d.Length() : d;
+    };
+
+    bool withDepth = !depth.empty();
+    double minCosine = cos(Deg2Rad * maxDegrees);
+    merged.clear();
+    merged.reserve(chains.size() - 1, withDepth);
+    if (sources)
+    {
+        sources->clear();
+    }
+
+    // Runs are measured against their first direction, so a slow curve can't drift into a chord
+    for (size_t c = 0; c + 1 < chains.size(); c++)
+    {
+        size_t b = chains[c];
+        while (b < chains[c + 1])
+        {
+            size_t first = b++;
+            vec3 forward = direction(first);
+            while (b < chains[c + 1] && (!withDepth || depth[b] == depth[first])
+                   && Dot(direction(b), forward) >= minCosine)
+            {
+                b++;
+            }
+
+            merged.push_back(vec3(startX[first], startY[first], startZ[first]),
+                             vec3(endX[b - 1], endY[b - 1], endZ[b - 1]));
+            if (withDepth)
+            {
+                merged.depth.push_back(depth[first]);
+            }
+            if (sources)
+            {
+                sources->push_back(first);
+            }
+        }
+    }
+
+    if (sources)
+    {
+        sources->push_back(size());
+    }
+}
+
+LSystem::Result LSystem::process(unsigned int n, std::vector<Branch>& branches)
+{
+    VectorSink sink{ branches, nullptr };
+    return processInto(n, sink);
+}
+
+LSystem::Result LSystem::process(unsigned int n, std::vector<Branch>& branches,
+                                 std::vector<Geometry>& models)
+{
+    VectorSink sink{ branches, &models };
+    return processInto(n, sink);
+}
+
+LSystem::Result LSystem::process(unsigned int n, BranchBuffers& buffers, bool withDepth)
+{
+    BufferSink sink{ buffers, withDepth };
+    return processInto(n, sink);
+}
+
+LSystem::Result LSystem::process(unsigned int n, GeometrySink& target)
+{
+    CallbackSink sink(target, mBudget.maxBranches > 0 ? mBudget.maxBranches : SIZE_MAX);
+    Result result = processInto(n, sink);
+    sink.flush();
+    return result;
+}
+
+template <typename Sink>
+LSystem::Result LSystem::processInto(unsigned int n, Sink& sink)
+{
+    Result result = checkBudget(n);
+    if (result.iteration < 0)
+    {
+        mLastResult = result;
+        return result;
+    }
+    n = static_cast<unsigned int>(result.iteration);
+
+    Turtle turtle;
+
+    // Init so we're pointing up
+    turtle.applyLeftRot(-90);
+
+    // Reserve what the prediction asks for, within the budget. Without one, a prediction past
+    // k_MAX_RESERVE is left to grow on demand rather than allocated before anything is drawn.
+    GrowthStats stats = analyzeGrowth(n);
+    auto bounded = [this](uint64_t count, size_t bytes)
+    {
+        if (mBudget.maxBytes > 0)
+        {
+            count = std::min<uint64_t>(count, mBudget.maxBytes / bytes);
+        }
+        return count <= k_MAX_RESERVE ? count : 0;
+    };
+    uint64_t reserveBranches = mBudget.maxBranches > 0
+                                   ? std::min<uint64_t>(stats.branches, mBudget.maxBranches)
+                                   : stats.branches;
+    sink.reserve(bounded(reserveBranches, sizeof(Branch)),
+                 bounded(stats.models, sizeof(Geometry)));
+
+    // Predictions of stochastic and parametric grammars are only expectations. Branches already
+    // handed to a sink can't be taken back, so a stop while drawing reports the iteration drawn.
+    size_t maxBranches = mBudget.maxBranches > 0 ? sink.branchCount() + mBudget.maxBranches
+                                                 : SIZE_MAX;
+    auto overBudget = [&]()
+    {
+        if (sink.branchCount() <= maxBranches)
+        {
+            return false;
+        }
+        sink.truncate(maxBranches);
+        result = { Status::BranchLimit, result.iteration, true };
+        return true;
+    };
+
+    // a ']' without its '[' would pop an empty stack, so a malformed string is not interpreted
+    auto unbalanced = [&](const BracketProfile& brackets)
+    {
+        if (brackets.balanced())
+        {
+            return false;
+        }
+        result = { Status::UnbalancedBrackets, result.iteration };
+        mLastResult = result;
+        return true;
+    };
+
+    bool culling = isCulling();
+    bool parallel = mParallelTurtle && mThreadCount > 1;
+    if (mParametric)
+    {
+        const ModuleString& modules = getModules(n);
+        result = mLastResult.ok() ? result : mLastResult;
+        const char* symbols = modules.symbols.data();
+        BracketProfile brackets = scanBrackets(symbols, symbols + modules.symbols.size());
+        if (unbalanced(brackets))
+        {
+            return result;
+        }
+
+        if (culling)
+        {
+            interpretCulled(modules.symbols, &modules, result.iteration, turtle,
+                            brackets.maxDepth, sink);
+        }
+        else if (parallel && modules.symbols.size() >= k_PARALLEL_MIN_SYMBOLS)
+        {
+            interpretParallel(modules.symbols, &modules, turtle, brackets.maxDepth, sink);
+        }
+        else
+        {
+            TurtleStack stack(brackets.maxDepth);
+            for (size_t i = 0; i < modules.symbols.size() && !overBudget(); i++)
+            {
+                uint32_t offset = modules.paramOffsets[i];
+                interpret(modules.symbols[i], modules.params.data() + offset,
+                          modules.paramOffsets[i + 1] - offset, turtle, stack, sink);
+            }
+        }
+        overBudget();
+        mLastResult = result;
+        return result;
+    }
+
+    // context rules, culling and parallel chunks need a whole iteration, and so does a stochastic
+    // string whose brackets cannot be validated from the grammar. One that is already resident is
+    // cheaper to read than to stream.
+    BracketProfile brackets;
+    if (mContextSensitive || culling || parallel || (n < iterations.size() && mLastUse[n] != 0)
+        || !predictBrackets(n, brackets))
+    {
+        const std::string& iteration = getIteration(n);
+        result = mLastResult.ok() ? result : mLastResult;
+        brackets = scanBrackets(iteration.data(), iteration.data() + iteration.size());
+        if (unbalanced(brackets))
+        {
+            return result;
+        }
+
+        if (culling)
+        {
+            interpretCulled(iteration, nullptr, result.iteration, turtle, brackets.maxDepth, sink);
+        }
+        else if (parallel && iteration.size() >= k_PARALLEL_MIN_SYMBOLS)
+        {
+            interpretParallel(iteration, nullptr, turtle, brackets.maxDepth, sink);
+        }
+        else
+        {
+            TurtleStack stack(brackets.maxDepth);
+            for (size_t i = 0; i < iteration.size() && !overBudget(); i++)
+            {
+                interpret(iteration[i], nullptr, 0, turtle, stack, sink);
+            }
+        }
+        overBudget();
+        mLastResult = result;
+        return result;
+    }
+
+    if (unbalanced(brackets))
+    {
+        return result;
+    }
+
+    TurtleStack stack(brackets.maxDepth);
+    DerivationStream stream(*this, n);
+    char sym;
+    while (!overBudget() && stream.next(sym))
+    {
+        interpret(sym, nullptr, 0, turtle, stack, sink);
+    }
+    mLastResult = result;
+    return result;
+}
+
+vec3 LSystem::Transform::apply(const vec3& point) const
+{
+    return pos + point[0] * forward + point[1] * left + point[2] * up;
+}
+
+LSystem::Transform LSystem::Transform::operator*(const Transform& local) const
+{
+    Transform world;
+    world.pos = apply(local.pos);
+    world.forward = local.forward[0] * forward + local.forward[1] * left + local.forward[2] * up;
+    world.left = local.left[0] * forward + local.left[1] * left + local.left[2] * up;
+    world.up = local.up[0] * forward + local.up[1] * left + local.up[2] * up;
+    return world;
+}
+
+void LSystem::InstanceHierarchy::clear()
+{
+    prototypes.clear();
+    root = 0;
+}
+
+void LSystem::InstanceHierarchy::flatten(std::vector<Branch>& branches,
+                                         std::vector<Geometry>& models) const
+{
+    VectorSink sink{ branches, &models };
+    flatten(sink);
+}
+
+void LSystem::InstanceHierarchy::flatten(BranchBuffers& buffers) const
+{
+    BufferSink sink{ buffers, false };
+    flatten(sink);
+}
+
+template <typename Sink>
+void LSystem::InstanceHierarchy::flatten(Sink& sink) const
+{
+    if (prototypes.empty())
+    {
+        return;
+    }
+
+    // children come first, so totals accumulate in a single pass
+    std::vector<uint64_t> branchCounts(prototypes.size());
+    std::vector<uint64_t> modelCounts(prototypes.size());
+    for (size_t i = 0; i < prototypes.size(); i++)
+    {
+        branchCounts[i] = prototypes[i].branches.size();
+        modelCounts[i] = prototypes[i].models.size();
+        for (const Instance& child : prototypes[i].children)
+        {
+            branchCounts[i] += branchCounts[child.prototype];
+            modelCounts[i] += modelCounts[child.prototype];
+        }
+    }
+    sink.reserve(branchCounts[root], modelCounts[root]);
+
+    // Depth first, each prototype's own primitives interleaved with its instances as the turtle
+    // drew them, so the output is in the order process() gives and unbranched runs stay adjacent
+    struct Placement
+    {
+        uint32_t prototype;
+        Transform transform;
+        size_t branch;  // next own primitives and instance to emit
+        size_t model;
+        size_t child;
+    };
+    auto emit = [&sink](const Prototype& prototype, Placement& placement, size_t branches,
+                        size_t models)
+    {
+        const Transform& transform = placement.transform;
+        for (; placement.branch < branches; placement.branch++)
+        {
+            const Branch& branch = prototype.branches[placement.branch];
+            sink.addBranch(transform.apply(branch.first), transform.apply(branch.second), 0);
+        }
+        for (; placement.model < models; placement.model++)
+        {
+            const Geometry& model = prototype.models[placement.model];
+            sink.addModel(transform.apply(model.first), model.second);
+        }
+    };
+
+    std::vector<Placement> pending{ { root,
+                                      { vec3(0, 0, 0), vec3(1, 0, 0), vec3(0, 1, 0),
+                                        vec3(0, 0, 1) },
+                                      0, 0, 0 } };
+    while (!pending.empty())
+    {
+        Placement& placement = pending.back();
+        const Prototype& prototype = prototypes[placement.prototype];
+        if (placement.child == prototype.children.size())
+        {
+            emit(prototype, placement, prototype.branches.size(), prototype.models.size());
+            pending.pop_back();
+            continue;
+        }
+
+        const Instance& child = prototype.children[placement.child++];
+        emit(prototype, placement, child.branches, child.models);
+        Transform transform = placement.transform * child.transform;
+        pending.push_back({ child.prototype, transform, 0, 0, 0 });  // may move placement
+    }
+}
+
+bool LSystem::isInstanceable() const
+{
+    if (mStochastic || mParametric || mContextSensitive || isCulling() || hasProduction('[')
+        || hasProduction(']'))
+    {
+        return false;
+    }
+
+    for (unsigned int sym = 0; sym < 256; sym++)
+    {
+        const char* successor = mSuccessorData.data() + mSuccessors[sym].offset;
+        if (hasProduction(sym)
+            && !scanBrackets(successor, successor + mSuccessors[sym].length).balanced())
+        {
+            return false;
+        }
+    }
+    return scanBrackets(mAxiom.data(), mAxiom.data() + mAxiom.size()).balanced();
+}
+
+bool LSystem::process(unsigned int n, InstanceHierarchy& hierarchy)
+{
+    hierarchy.clear();
+    if (!isInstanceable())
+    {
+        return false;
+    }
+
+    // the hierarchy itself stays small, but flatten() emits every branch it stands for
+    mLastResult = checkBudget(n);
+    n = static_cast<unsigned int>(mLastResult.iteration);
+
+    // the axiom is the root, with every symbol rewritten n + 1 times
+    InstanceHierarchy::Prototype root;
+    if (mLastResult.iteration >= 0)
+    {
+        std::vector<uint32_t> prototypeIds(static_cast<size_t>(n + 2) * 256, UINT32_MAX);
+        Turtle turtle;
+        turtle.applyLeftRot(-90);  // Init so we're pointing up
+        addInstances(mAxiom.data(), mAxiom.data() + mAxiom.size(), n + 1, turtle, root,
+                     hierarchy, prototypeIds);
+    }
+
+    hierarchy.root = static_cast<uint32_t>(hierarchy.prototypes.size());
+    hierarchy.prototypes.push_back(std::move(root));
+    return true;
+}
+
+uint32_t LSystem::addPrototype(unsigned char sym, unsigned int depth,
+                               InstanceHierarchy& hierarchy,
+                               std::vector<uint32_t>& prototypeIds) const
+{
+    uint32_t& id = prototypeIds[depth * 256 + sym];
+    if (id != UINT32_MAX)
+    {
+        return id;
+    }
+
+    InstanceHierarchy::Prototype prototype;
+    Turtle turtle;
+    const char* successor = mSuccessorData.data() + mSuccessors[sym].offset;
+    addInstances(successor, successor + mSuccessors[sym].length, depth - 1, turtle, prototype,
+                 hierarchy, prototypeIds);
+
+    id = static_cast<uint32_t>(hierarchy.prototypes.size());
+    hierarchy.prototypes.push_back(std::move(prototype));
+    return id;
+}
+
+void LSystem::addInstances(const char* begin, const char* end, unsigned int depth, Turtle& turtle,
+                           InstanceHierarchy::Prototype& prototype, InstanceHierarchy& hierarchy,
+                           std::vector<uint32_t>& prototypeIds) const
+{
+    TurtleStack stack(scanBrackets(begin, end).maxDepth);
+    for (const char* sym = begin; sym != end; sym++)
+    {
+        unsigned char c = static_cast<unsigned char>(*sym);
+        if (depth == 0 || !hasProduction(c))
+        {
+            VectorSink sink{ prototype.branches, &prototype.models };
+            interpret(*sym, nullptr, 0, turtle, stack, sink);
+            continue;
+        }
+
+        // place the shared expansion here, then continue from where it leaves the turtle
+        uint32_t id = addPrototype(c, depth, hierarchy, prototypeIds);
+        const InstanceHierarchy::Prototype& child = hierarchy.prototypes[id];
+        Transform frame = turtle.getFrame();
+        if (!child.branches.empty() || !child.models.empty() || !child.children.empty())
+        {
+            prototype.children.push_back({ id, frame,
+                                           static_cast<uint32_t>(prototype.branches.size()),
+                                           static_cast<uint32_t>(prototype.models.size()) });
+        }
+        turtle.setFrame(frame * child.end);
+    }
+    prototype.end = turtle.getFrame();
+}
+
+template <typename Sink>
+void LSystem::interpretParallel(const std::string& symbols, const ModuleString* modules,
+                                const Turtle& start, size_t maxDepth, Sink& sink) const
+{
+    size_t numChunks = mThreadCount;
+    size_t chunkSize = (symbols.size() + numChunks - 1) / numChunks;
+    auto chunkStart = [&](size_t chunk)
+    {
+        size_t index = chunk * chunkSize;
+        return index < symbols.size() ? index : symbols.size();
+    };
+    auto interpretSymbol = [&](size_t i, Turtle& turtle, TurtleStack& stack, auto& out)
+    {
+        uint32_t offset = modules ? modules->paramOffsets[i] : 0;
+        uint32_t count = modules ? modules->paramOffsets[i + 1] - offset : 0;
+        interpret(symbols[i], modules ? modules->params.data() + offset : nullptr, count, turtle,
+                  stack, out);
+    };
+
+    // 1. Summarize every chunk, run from the identity frame. No local stack gets deeper than the
+    // whole string does. A ']' whose '[' came before the chunk restarts the turtle at an outer
+    // state, so the pushes left open and the end state are relative to the last such state, or
+    // to the chunk's start when there is none.
+    struct Summary
+    {
+        size_t pops;                // of states pushed before the chunk
+        std::vector<Turtle> pushes; // left open, outermost first
+        Turtle end;
+    };
+    std::vector<Summary> summaries(numChunks);
+    parallelFor(numChunks, mThreadCount, [&](size_t chunk)
+                {
+                    Summary& summary = summaries[chunk];
+                    summary.pops = 0;
+                    Turtle turtle;
+                    TurtleStack stack(maxDepth);
+                    NullSink none;
+                    for (size_t i = chunkStart(chunk); i < chunkStart(chunk + 1); i++)
+                    {
+                        TurtleOp op = mCommands[static_cast<unsigned char>(symbols[i])].op;
+                        if (stack.size() == 0 && op == TurtleOp::Pop)
+                        {
+                            summary.pops++;
+                            turtle = Turtle();
+                            continue;
+                        }
+                        interpretSymbol(i, turtle, stack, none);
+                    }
+                    while (stack.size() > 0)
+                    {
+                        summary.pushes.push_back(stack.pop());
+                    }
+                    std::reverse(summary.pushes.begin(), summary.pushes.end());
+                    summary.end = turtle;
+                });
+
+    // 2. Scan the summaries in order for the turtle and bracket stack every chunk starts with
+    std::vector<Turtle> starts(numChunks);
+    std::vector<std::vector<Turtle>> stacks(numChunks);
+    Turtle turtle = start;
+    std::vector<Turtle> stack;
+    auto place = [](const Turtle& base, const Turtle& local)
+    {
+        Turtle placed;
+        placed.setFrame(base.getFrame() * local.getFrame());
+        return placed;
+    };
+    for (size_t chunk = 0; chunk < numChunks; chunk++)
+    {
+        starts[chunk] = turtle;
+        stacks[chunk] = stack;
+
+        const Summary& summary = summaries[chunk];
+        Turtle base = turtle;
+        for (size_t i = 0; i < summary.pops && !stack.empty(); i++)
+        {
+            base = stack.back();
+            stack.pop_back();
+        }
+        for (const Turtle& push : summary.pushes)
+        {
+            stack.push_back(place(base, push));
+        }
+        turtle = place(base, summary.end);
+    }
+
+    // 3. Interpret every chunk from its start state, then append the outputs in order
+    ChunkSink empty = { sink.wantsModels(), sink.wantsBrackets(), {}, {}, {}, {} };
+    std::vector<ChunkSink> outputs(numChunks, empty);
+    parallelFor(numChunks, mThreadCount, [&](size_t chunk)
+                {
+                    Turtle turtle = starts[chunk];
+                    TurtleStack stack(maxDepth);
+                    for (const Turtle& state : stacks[chunk])
+                    {
+                        stack.push(state);
+                    }
+                    for (size_t i = chunkStart(chunk); i < chunkStart(chunk + 1); i++)
+                    {
+                        interpretSymbol(i, turtle, stack, outputs[chunk]);
+                    }
+                });
+
+    for (const ChunkSink& output : outputs)
+    {
+        size_t next = 0;
+        auto addBranches = [&](size_t end)
+        {
+            for (; next < end; next++)
+            {
+                sink.addBranch(output.branches[next].first, output.branches[next].second,
+                               output.depths[next]);
+            }
+        };
+        for (const GeometrySink::Bracket& bracket : output.brackets)
+        {
+            addBranches(bracket.branch);
+            sink.addBracket(bracket.pos, bracket.depth, bracket.push);
+        }
+        addBranches(output.branches.size());
+        for (const Geometry& model : output.models)
+        {
+            sink.addModel(model.first, model.second);
+        }
+    }
+}
+
+// Depth and leaf culling skip a subtree at its '['. A branch too short to see drops the rest of
+// its subtree as well, since what grows out of it is smaller still; outside any brackets the
+// turtle only moves past it. A skipped subtree leaves the turtle as it found it, so the jump to
+// its ']' changes nothing else.
+template <typename Sink>
+void LSystem::interpretCulled(const std::string& symbols, const ModuleString* modules,
+                              unsigned int iteration, Turtle& turtle, size_t maxDepth,
+                              Sink& sink) const
+{
+    std::vector<BracketMatch> matches;
+    matchBrackets(symbols, maxDepth, matches);
+
+    TurtleStack stack(maxDepth);
+    std::vector<uint64_t> open;  // brackets the turtle is inside
+    open.reserve(maxDepth);
+    uint64_t next = 0;           // index of the next '['
+    for (size_t i = 0; i < symbols.size(); i++)
+    {
+        const Command& command = mCommands[static_cast<unsigned char>(symbols[i])];
+        uint32_t offset = modules ? modules->paramOffsets[i] : 0;
+        uint32_t numParams = modules ? modules->paramOffsets[i + 1] - offset : 0;
+        const float* params = modules ? modules->params.data() + offset : nullptr;
+
+        if (command.op == TurtleOp::Push)
+        {
+            const BracketMatch& match = matches[next];
+            if ((mDetail.maxDepth > 0 && stack.size() >= mDetail.maxDepth)
+                || (match.leaf && mDetail.leafFraction > 0.0f && mDetail.leafFraction < 1.0f
+                    && randomSample(mSeed, iteration, i) >= mDetail.leafFraction))
+            {
+                i = match.close;
+                next = match.nextOpen;
+                continue;
+            }
+            open.push_back(next++);
+        }
+        else if (command.op == TurtleOp::Pop)
+        {
+            open.pop_back();
+        }
+        else if (command.op == TurtleOp::Draw && mDetail.minProjectedLength > 0.0f)
+        {
+            float length = numParams > 0 ? params[0] * command.scale : command.step;
+            vec3 middle = turtle.pos + 0.5 * length * turtle.forward;
+            if (fabs(length) < mDetail.minProjectedLength * (middle - mDetail.eye).Length())
+            {
+                if (open.empty())
+                {
+                    turtle.moveForward(length);
+                    continue;
+                }
+                i = matches[open.back()].close - 1;  // the ']' itself still restores the turtle
+                next = matches[open.back()].nextOpen;
+                continue;
+            }
+        }
+        interpret(symbols[i], params, numParams, turtle, stack, sink);
+    }
+}
+
+template <typename Sink>
+void LSystem::interpret(char sym, const float* params, uint32_t numParams, Turtle& turtle,
+                        TurtleStack& stack, Sink& sink) const
+{
+    // a module's first parameter, scaled like the defaults, overrides the precomputed step or turn
+    const Command& command = mCommands[static_cast<unsigned char>(sym)];
+    float amount = numParams > 0 ? params[0] * command.scale : command.step;
+    switch (command.op)
+    {
+        case TurtleOp::Draw:
+        {
+            vec3 start = turtle.pos;
+            turtle.moveForward(amount);
+            sink.addBranch(start, turtle.pos, stack.size());
+            break;
+        }
+        case TurtleOp::Move: turtle.moveForward(amount); break;
+        case TurtleOp::Turn:
+            turtle.applyUpRot(numParams > 0 ? Rotation(amount) : command.rotation);
+            break;
+        case TurtleOp::Pitch:
+            turtle.applyLeftRot(numParams > 0 ? Rotation(amount) : command.rotation);
+            break;
+        case TurtleOp::Roll:
+            turtle.applyForwardRot(numParams > 0 ? Rotation(amount) : command.rotation);
+            break;
+        case TurtleOp::TurnAround: turtle.applyUpRot(command.rotation); break;
+        case TurtleOp::Push:
+            stack.push(turtle);
+            sink.addBracket(turtle.pos, stack.size(), true);
+            break;
+        case TurtleOp::Pop:
+            sink.addBracket(turtle.pos, stack.size(), false);
+            turtle = stack.pop();
+            break;
+        case TurtleOp::Model:
+            sink.addModel(turtle.pos, mSymbolNames[static_cast<unsigned char>(sym)]);
+            break;
+        case TurtleOp::None: break;
     }
 }
@@ -1,9 +1,12 @@
 #ifndef LSystem_H_
 #define LSystem_H_
 
+#include <array>
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <map>
+#include "expression.h"
 #include "vec.h"
 
 class LSystem
@@ -12,41 +15,540 @@ public:
     typedef std::pair<vec3, std::string> Geometry;
     typedef std::pair<vec3, vec3> Branch;
 
+    // A branch meshed on its own: two rings of ten sides and two cap centers. Welded tubes share
+    // rings between the branches of a chain, so they take fewer.
+    static constexpr uint64_t k_VERTICES_PER_BRANCH = 22;
+
+    // Which derived iterations getIteration() keeps resident. Evicted iterations are regenerated
+    // from the nearest iteration that is still resident.
+    enum class CachePolicy
+    {
+        KeepAll,     // every iteration up to the deepest one requested
+        KeepLatest,  // only the most recently requested iteration
+        ByteBudget   // least recently used iterations are evicted once over the byte budget
+    };
+
+    // Size of an iteration predicted from the production count matrix, without deriving it
+    struct GrowthStats
+    {
+        std::array<uint64_t, 256> symbolCounts;  // Parikh vector of the iteration
+        uint64_t symbols;
+        uint64_t branches;  // symbols that draw a branch
+        uint64_t models;    // symbols that are not turtle commands
+        uint64_t vertices;  // of a mesh at most, k_VERTICES_PER_BRANCH for every branch
+        double growthRate;  // asymptotic factor the string length grows by per iteration
+        bool saturated;     // a count exceeded UINT64_MAX and was clamped
+        bool exact;         // false when counts are estimates (stochastic, parametric, context)
+    };
+
+    // Parametric modules such as F(1.5,0.2): one symbol per module, with every module's
+    // parameters stored contiguously in a side buffer
+    struct ModuleString
+    {
+        std::string symbols;
+        std::vector<uint32_t> paramOffsets;  // symbols.size() + 1 offsets into params
+        std::vector<float> params;
+
+        void clear();
+        void append(char sym, const float* values, uint32_t count);
+    };
+
+    // Limits on what getIteration() and process() may build, 0 leaving a quantity unlimited
+    struct Budget
+    {
+        uint64_t maxSymbols;   // symbols of a derived iteration
+        uint64_t maxBranches;  // branches a single process() call emits
+        size_t maxBytes;       // resident iterations plus the geometry process() emits
+    };
+
+    // Level of detail of process(), 0 leaving a control off. Culling needs the whole iteration,
+    // whose subtrees are skipped in constant time through an index of matching brackets.
+    struct Detail
+    {
+        vec3 eye;                  // where projected lengths are measured from
+        float minProjectedLength;  // branch length over its distance to eye; a shorter branch is
+                                   // dropped along with the rest of the subtree it is in
+        unsigned int maxDepth;     // deeper bracketed subtrees are skipped whole
+        float leafFraction;        // share of the leaves kept, all of them at 0 or 1; a leaf is
+                                   // a bracketed subtree that draws but has no nested one that
+                                   // does, so brackets holding only an apex like [+X] don't count
+    };
+
+    enum class Status
+    {
+        Ok,
+        SymbolLimit,
+        BranchLimit,
+        MemoryLimit,
+        UnbalancedBrackets  // a ']' without its '[' or a '[' never closed; nothing is interpreted
+    };
+
+    struct Result
+    {
+        Status status;
+        int iteration;  // deepest iteration that fit the budget, -1 when not even the first did,
+                        // or the one process() was drawing when it reached maxBranches
+        bool truncated = false;  // process() kept only the first maxBranches branches of it
+
+        bool ok() const { return status == Status::Ok; }
+    };
+
+    // What the turtle does for a symbol. Turns, pitches and rolls go the positive way for a
+    // positive scale, so '+' is Turn with scale 1 and '-' is Turn with scale -1.
+    enum class TurtleOp : uint8_t
+    {
+        None,        // skipped, like a symbol that only drives the derivation
+        Draw,        // move forward and draw a branch
+        Move,        // move forward without drawing
+        Turn,        // about the up axis
+        Pitch,       // about the left axis
+        Roll,        // about the forward axis
+        TurnAround,  // half turn about the up axis
+        Push,
+        Pop,
+        Model        // emit the symbol as a model, the default for symbols without a command
+    };
+
+    // Branches as one contiguous float array per coordinate, for consumers that batch or
+    // vectorize. depth holds the bracket nesting of every branch when it was asked for.
+    struct BranchBuffers
+    {
+        std::vector<float> startX, startY, startZ;
+        std::vector<float> endX, endY, endZ;
+        std::vector<uint16_t> depth;
+
+        size_t size() const { return startX.size(); }
+        void clear();
+        void reserve(size_t count, bool withDepth);
+        void resize(size_t count);
+        void push_back(const vec3& start, const vec3& end);
+
+        // First branch of every chain, ending with the branch count. A branch continues the
+        // chain of the one before it when it starts exactly where that one ends and is the only
+        // branch starting there, so a fork always begins new chains.
+        void findChains(std::vector<size_t>& chains) const;
+
+        // Merges runs of a chain that stay within maxDegrees of the run's first direction, and
+        // keep their depth, into one branch from the run's start to its end. sources gets the
+        // first branch of every run, ending with the branch count; without a level of detail,
+        // branch i is the one the i-th drawing symbol of the iteration draws. merged can't be
+        // these buffers.
+        void mergeCollinear(float maxDegrees, BranchBuffers& merged,
+                            std::vector<size_t>* sources = nullptr) const;
+    };
+
+    // Rigid transform given by a position and the turtle's forward, left and up axes
+    struct Transform
+    {
+        vec3 pos;
+        vec3 forward;
+        vec3 left;
+        vec3 up;
+
+        vec3 apply(const vec3& point) const;  // point in forward/left/up coordinates
+        Transform operator*(const Transform& local) const;
+    };
+
+    // A derived plant as shared subtrees. Every (symbol, depth) expansion is interpreted once in
+    // its own frame, and each of its occurrences places that prototype with a transform.
+    struct InstanceHierarchy
+    {
+        struct Instance
+        {
+            uint32_t prototype;
+            Transform transform;  // relative to the frame of the prototype holding the instance
+            uint32_t branches;    // of the holding prototype's own, drawn before the instance
+            uint32_t models;
+        };
+
+        struct Prototype
+        {
+            std::vector<Branch> branches;
+            std::vector<Geometry> models;
+            std::vector<Instance> children;
+            Transform end;  // turtle after the expansion, which places whatever follows it
+        };
+
+        std::vector<Prototype> prototypes;  // children come before their parents
+        uint32_t root;                      // in the turtle's world frame
+
+        void clear();
+        void flatten(std::vector<Branch>& branches, std::vector<Geometry>& models) const;
+        void flatten(BranchBuffers& buffers) const;  // without depths
+
+    private:
+        template <typename Sink>
+        void flatten(Sink& sink) const;
+    };
+
+    // Consumer of what process() draws, handed over in batches while the turtle runs so nothing
+    // has to hold a whole plant. Pointers are only valid during the call. Models and bracket
+    // events are only produced for a sink that asks for them.
+    class GeometrySink
+    {
+    public:
+        struct Bracket
+        {
+            vec3 pos;        // where the turtle meets the bracket
+            uint32_t depth;  // nesting inside the bracket, 1 for the outermost
+            bool push;       // '[' when true, ']' otherwise
+            uint64_t branch; // branches drawn before it, which places it among the branch batches
+        };
+
+        virtual ~GeometrySink() {}
+
+        virtual bool wantsModels() const { return false; }
+        virtual bool wantsBrackets() const { return false; }
+
+        // depths[i] is the bracket nesting of branches[i]. A batch of models or brackets comes
+        // after the batch of branches drawn before them.
+        virtual void onBranches(const Branch* branches, const uint32_t* depths, size_t count) = 0;
+        virtual void onModels(const Geometry*, size_t) {}
+        virtual void onBrackets(const Bracket*, size_t) {}
+    };
+
 public:
     LSystem();
 
     ~LSystem() {}
 
-    // Set/get inputs
+    // Set/get inputs. Reloading an edited grammar keeps the cached iterations the edit leaves
+    // valid and rebuilds the others from the old expansions of the symbols it didn't affect.
     void loadProgram(const std::string& fileName);
     void loadProgramFromString(const std::string& program);
     void setDefaultAngle(float degrees);
     void setDefaultStep(float distance);
+    void setThreadCount(unsigned int threads);  // 0 uses every hardware thread
+
+    // Interprets long iterations on every thread: chunks are summarized as turtle transforms and
+    // bracket stack changes, scanned for their start states, then interpreted concurrently.
+    // Needs the whole iteration in memory, where process() otherwise streams it.
+    void setParallelInterpretation(bool enable);
+    void setSeed(uint32_t seed);                // picks the variation of a stochastic grammar
+    void setBudget(const Budget& budget);
+    void setDetail(const Detail& detail);
+
+    // Symbol commands, on top of the defaults "F f + - & ^ \ / | [ ]". scale multiplies the
+    // default step or angle, or a module's first parameter. Brackets always push and pop, since
+    // the derivation relies on them, so they can't be remapped and no other symbol can take
+    // Push or Pop. A multi-character name not seen before is interned right away, which reloads
+    // the grammar so its text picks the name up; false, changing nothing, when it can't be, as
+    // for a name holding grammar punctuation or past the 128 names.
+    bool registerCommand(const std::string& symbol, TurtleOp op, float scale = 1.0f);
+    void resetCommands();
 
     float getDefaultAngle() const;
     float getDefaultStep() const;
+    unsigned int getThreadCount() const;
+    uint32_t getSeed() const;
+    const Budget& getBudget() const;
+    const Detail& getDetail() const;
+    bool isStochastic() const;
+    bool isParametric() const;
+    bool isContextSensitive() const;
     const std::string& getGrammarString() const;
+    const std::vector<std::string>& getErrors() const;  // problems found loading the grammar
 
-    // Iterate grammar
+    // Iterations hold one byte per symbol. Multi-character names, either used as a predecessor
+    // or declared with "#symbols: leaf,bud", are interned into the codes from k_FIRST_NAME up.
+    const std::string& getSymbolName(unsigned char sym) const;
+    std::string toText(const std::string& symbols) const;  // spells interned names out again
+
+    // Iterate grammar. Once the budget runs out, derivation stops and getIteration() returns the
+    // deepest iteration that fit; getLastResult() tells which one that is.
     const std::string& getIteration(unsigned int n);
+    const ModuleString& getModules(unsigned int n);  // parametric grammars only
+    GrowthStats analyzeGrowth(unsigned int n) const;
+    void setCachePolicy(CachePolicy policy, size_t byteBudget = 0);
+    CachePolicy getCachePolicy() const;
+    size_t getResidentBytes() const;  // cached iterations plus the rewrite buffers
+    Result checkBudget(unsigned int n) const;  // from the predicted sizes, without deriving
+    const Result& getLastResult() const;       // of the latest getIteration() or process()
+
+    // Get geometry from running the turtle. Over budget, the deepest iteration that fits is
+    // processed instead. A branch count that outgrows its prediction stops at the limit, keeping
+    // the first maxBranches branches of the iteration drawn, which the result then names.
+    Result process(unsigned int n, std::vector<Branch>& branches);
+    Result process(unsigned int n, std::vector<Branch>& branches, std::vector<Geometry>& models);
+    Result process(unsigned int n, BranchBuffers& buffers, bool withDepth = false);  // no models
+    Result process(unsigned int n, GeometrySink& sink);
 
-    // Get geometry from running the turtle
-    void process(unsigned int n, std::vector<Branch>& branches);
-    void process(unsigned int n, std::vector<Branch>& branches, std::vector<Geometry>& models);
+    // Only for deterministic, context-free, non-parametric grammars whose successors have balanced
+    // brackets, since only then is a subtree independent of where it occurs, and only without a
+    // level of detail, whose culling depends on where a subtree ends up. Returns false and
+    // leaves hierarchy empty otherwise. Over budget, the hierarchy of the deepest iteration that
+    // fits is built instead, as getLastResult() reports.
+    bool process(unsigned int n, InstanceHierarchy& hierarchy);
 
     void reset();
 
+    class CompressedIteration;
+    CompressedIteration getCompressedIteration(unsigned int n);
+
+    // Depth-first cursor over the symbols of iteration n. Successors are expanded on demand, so
+    // memory is proportional to the number of iterations rather than to the string length.
+    // Context-sensitive rules need the neighbouring symbols and parametric modules their values,
+    // so for those grammars the stream is empty; process() derives them via getIteration().
+    class DerivationStream
+    {
+    public:
+        DerivationStream(const LSystem& system, unsigned int n);
+
+        bool next(char& sym);
+
+    private:
+        struct Frame
+        {
+            const char* pos;
+            const char* end;
+        };
+
+        const LSystem& mSystem;
+        std::vector<Frame> mStack;         // one frame per expanded level
+        std::vector<uint64_t> mPositions;  // symbols consumed so far on each level
+        size_t mTarget;                    // stack level whose symbols belong to iteration n
+    };
+
+    // Iteration n stored as a straight-line program: every symbol of the axiom is a (symbol, depth)
+    // node whose expansion is shared by all its occurrences, so only the expansion lengths are kept.
+    // Stochastic, context-sensitive and parametric grammars break that sharing, so for them, as
+    // after loading another grammar, valid() is false, length() is 0 and operator[] returns '\0'.
+    // stream() derives from the grammar loaded at the time, stochastic ones included.
+    class CompressedIteration
+    {
+    public:
+        bool valid() const;
+        uint64_t length() const;  // saturates at UINT64_MAX
+        char operator[](uint64_t index) const;
+        DerivationStream stream() const;
+
+    private:
+        friend class LSystem;
+        CompressedIteration(const LSystem& system, unsigned int n);
+
+        const LSystem& mSystem;
+        unsigned int mIteration;
+        uint64_t mGeneration;  // of the grammar the view was made from
+    };
+
 protected:
+    class Turtle;
+    class TurtleStack;
+
+    // Bracket nesting of a run of symbols, relative to the depth the run starts at
+    struct BracketProfile
+    {
+        int64_t net;       // depth at the end
+        int64_t minDepth;  // lowest depth reached, negative when a ']' has no '['
+        int64_t maxDepth;  // highest depth reached
+
+        bool balanced() const { return net == 0 && minDepth >= 0; }
+    };
+
+    struct BracketMatch
+    {
+        uint64_t close;     // position of the ']' closing a '['
+        uint64_t nextOpen;  // index of the first '[' after the ']', the next index when none nest
+        bool draws;         // a branch is drawn somewhere inside
+        bool leaf;          // draws, but no bracket nested inside does
+    };
+
+    struct Production
+    {
+        std::string successor;
+        float probability;
+        bool stochastic;  // written as "a -(p)-> b"; alternatives accumulate instead of replacing
+    };
+
+    struct Successor
+    {
+        uint32_t offset;  // into mSuccessorData
+        uint32_t length;
+    };
+
+    struct Range
+    {
+        uint32_t first;
+        uint32_t count;
+    };
+
+    // Derivation state saved across a reload, to find out what an edited grammar can reuse
+    struct PreviousDerivation
+    {
+        bool contextFree;  // neither context-sensitive nor parametric
+        bool stochastic;
+        std::string axiom;
+        std::vector<std::string> symbolNames;
+        std::vector<std::string> rules;  // signature of every symbol's productions
+        std::vector<std::string> iterations;
+        std::vector<uint64_t> lastUse;
+        std::vector<uint64_t> expansionLengths;
+    };
+
+    struct ContextRule
+    {
+        unsigned char left;   // 0 matches any left context
+        unsigned char right;  // 0 matches any right context
+        Successor successor;
+    };
+
+    struct ParametricRule
+    {
+        int32_t numFormals;  // -1 for plain productions, which match a module of any arity
+        ExpressionProgram::Expression condition;
+        std::string successor;            // symbol of every successor module
+        std::vector<uint32_t> argCounts;  // per successor module
+        std::vector<ExpressionProgram::Expression> args;
+    };
+
     void addProduction(std::string line);
-    std::string iterate(const std::string& input);
+    void compileProductions();
+    void clearIterations();
+    const Successor& getSuccessor(unsigned char sym, unsigned int iteration,
+                                  uint64_t position) const;
+    bool iterate(const std::string& input, std::string& output, unsigned int iteration,
+                 uint64_t maxSymbols = UINT64_MAX) const;
+    bool iterateParallel(const std::string& input, std::string& output, unsigned int iteration,
+                         uint64_t maxSymbols) const;
+    uint64_t getSymbolAllowance(Status& limit) const;
+    const Successor& selectSuccessor(unsigned char sym, unsigned int iteration,
+                                     uint64_t position) const;
+    void computeContexts(const std::string& input) const;
+    size_t countSuccessors(const char* begin, const char* end, unsigned int iteration,
+                           uint64_t position) const;
+    void writeSuccessors(const char* begin, const char* end, char* out, unsigned int iteration,
+                         uint64_t position) const;
+    void evictIterations(unsigned int keep);
+    std::string getRuleSignature(unsigned char sym) const;
+    void savePreviousDerivation(PreviousDerivation& previous);
+    void reuseIterations(PreviousDerivation& previous);
+    void buildCommands();
+    void internSymbols();
+    void internName(const std::string& name);
+    std::string tokenize(const std::string& text) const;
+    void compileParametricProductions();
+    bool compileParametricRule(const std::string& symFrom, const std::string& symTo, bool plain,
+                               unsigned char& sym, ParametricRule& rule);
+    const ParametricRule* findParametricRule(unsigned char sym, const float* params,
+                                             uint32_t count) const;
+    bool iterateParametric(const ModuleString& input, ModuleString& output, Status& limit) const;
+    void formatModules(const ModuleString& modules, std::string& text) const;
+    template <typename Sink>
+    Result processInto(unsigned int n, Sink& sink);
+    template <typename Sink>
+    void interpretParallel(const std::string& symbols, const ModuleString* modules,
+                           const Turtle& start, size_t maxDepth, Sink& sink) const;
+    template <typename Sink>
+    void interpretCulled(const std::string& symbols, const ModuleString* modules,
+                         unsigned int iteration, Turtle& turtle, size_t maxDepth, Sink& sink) const;
+    template <typename Sink>
+    void interpret(char sym, const float* params, uint32_t numParams, Turtle& turtle,
+                   TurtleStack& stack, Sink& sink) const;
+    static BracketProfile scanBrackets(const char* begin, const char* end);
+    bool predictBrackets(unsigned int n, BracketProfile& profile) const;
+    void matchBrackets(const std::string& symbols, size_t maxDepth,
+                       std::vector<BracketMatch>& matches) const;
+    bool isCulling() const;
+    bool isInstanceable() const;
+    uint32_t addPrototype(unsigned char sym, unsigned int depth, InstanceHierarchy& hierarchy,
+                          std::vector<uint32_t>& prototypeIds) const;
+    void addInstances(const char* begin, const char* end, unsigned int depth, Turtle& turtle,
+                      InstanceHierarchy::Prototype& prototype, InstanceHierarchy& hierarchy,
+                      std::vector<uint32_t>& prototypeIds) const;
+    bool predictSymbolCounts(unsigned int n, std::array<uint64_t, 256>& counts) const;
+    void applyExpectedCounts(const std::array<double, 256>& weights,
+                             std::array<double, 256>& next) const;
+    void computeExpansionLengths(unsigned int depth);
+    uint64_t getExpansionLength(unsigned char sym, unsigned int depth) const;
 
-    std::map<std::string, std::string> productions;
+    std::map<std::string, std::vector<Production>> productions;
     std::vector<std::string> iterations;
+    std::vector<uint64_t> mLastUse;  // per iteration; 0 when it is not resident
+    uint64_t mUseClock;
+    CachePolicy mCachePolicy;
+    size_t mCacheBudget;
+
+    // Successor of every byte, compiled from productions. Symbols without a production map to
+    // themselves, so rewriting is a table lookup and a copy per symbol.
+    Successor mSuccessors[256];
+    std::string mSuccessorData;
+
+    // Stochastic symbols pick one of their successors from a hash of (seed, iteration, position),
+    // so any derivation order reproduces the same string without carrying RNG state around
+    Range mAlternatives[256];  // into mStochasticSuccessors, count 0 for deterministic symbols
+    std::vector<Successor> mStochasticSuccessors;
+    std::vector<float> mStochasticThresholds;  // cumulative probability of each successor
+    bool mStochastic;
+    uint32_t mSeed;
+    std::vector<uint64_t> mExpansionLengths;  // 256 per depth: length of a symbol rewritten depth times
+    uint64_t mGeneration;  // counts compiled grammars, which invalidate compressed views
+
+    // Context-sensitive rules "a < b > c -> d" are tried in file order before the context-free
+    // successor. The nearest non-ignored neighbours of every symbol are found for a whole input in
+    // two linear scans that skip bracketed branches, then looked up by position while rewriting.
+    std::vector<std::pair<std::string, std::string>> mContextProductions;  // in file order
+    std::vector<ContextRule> mContextRules;  // grouped by predecessor symbol
+    Range mContextRanges[256];               // into mContextRules
+    bool mIgnored[256];                      // symbols skipped when looking for a context
+    bool mContextSensitive;
+    mutable std::string mLeftContext;  // per input symbol, 0 when there is none
+    mutable std::string mRightContext;
+
+    // Parametric grammars derive ModuleStrings instead of plain strings. Rules of a symbol are
+    // tried in file order and the first whose arity and condition match is applied.
+    std::vector<std::pair<std::string, std::string>> mParametricProductions;  // in file order
+    std::vector<ParametricRule> mParametricRules;  // grouped by predecessor symbol
+    Range mRuleRanges[256];                        // into mParametricRules
+    ExpressionProgram mExpressions;
+    bool mParametric;
+    ModuleString mAxiomModules;
+    ModuleString mModules;
+    ModuleString mModulesScratch;
+    int mModulesIteration;  // iteration held in mModules, -1 for the axiom
+    std::vector<std::string> mErrors;
+
+    // Grammar text is tokenized when it is compiled, matching the longest interned name first
+    static constexpr unsigned int k_FIRST_NAME = 0x80;
+    std::vector<std::string> mDeclaredNames;  // from "#symbols:" lines
+    std::vector<std::string> mSymbolNames;    // 256 entries, one character unless interned
+    std::vector<unsigned char> mNamesByLength;  // interned codes, longest name first
+    std::string mIgnoreList;                  // from "#ignore:" lines, tokenized into mIgnored
+
+    bool hasProduction(unsigned char sym) const;
 
+    // Cosine and sine of a turn, so rotating the turtle takes no trigonometry or allocation
+    struct Rotation
+    {
+        Rotation(double degrees = 0.0);
+
+        double c;
+        double s;
+    };
+
+    // Dispatch entry of a symbol, with its step and rotation resolved against the defaults
+    struct Command
+    {
+        TurtleOp op;
+        float scale;
+        float step;
+        Rotation rotation;
+    };
+
+    std::string mAxiomText;
+    std::string mAxiom;  // tokenized
     std::string current;
+    std::string mScratch;  // back buffer for iterate(), swapped with current after each step
+    int mCurrentIteration;  // iteration held in current, -1 for the axiom
     float mDfltAngle;
     float mDfltStep;
+    std::map<std::string, std::pair<TurtleOp, float>> mRegisteredCommands;
+    Command mCommands[256];  // rebuilt whenever a grammar, a command or a default changes
+    unsigned int mThreadCount;
+    bool mParallelTurtle;
     std::string mGrammar;
+    Budget mBudget;
+    Detail mDetail;
+    Result mLastResult;
 
     class Turtle
     {
@@ -55,16 +557,36 @@ protected:
         Turtle(const Turtle& t);
         Turtle& operator=(const Turtle& t);
 
+        // rotations about the turtle's own up, left and forward axes
         void moveForward(float distance);
-        void applyUpRot(float degrees);
-        void applyLeftRot(float degrees);
-        void applyForwardRot(float degrees);
+        void applyUpRot(const Rotation& rotation);
+        void applyLeftRot(const Rotation& rotation);
+        void applyForwardRot(const Rotation& rotation);
+
+        Transform getFrame() const;
+        void setFrame(const Transform& frame);
 
         vec3 pos;
         vec3 up;
         vec3 forward;
         vec3 left;
     };
+
+    // Turtle states saved by '[' in one flat array, sized up front from the validated nesting
+    // depth so interpretation never allocates and a push never outgrows it
+    class TurtleStack
+    {
+    public:
+        explicit TurtleStack(size_t capacity);
+
+        void push(const Turtle& turtle);
+        const Turtle& pop();
+        size_t size() const;
+
+    private:
+        std::vector<Turtle> mStates;
+        size_t mSize;
+    };
 };
 
 #endif
@@ -0,0 +1,313 @@
+#include "expression.h"
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+namespace
+{
+// Recursive descent parser that emits bytecode while it parses. Precedence from loosest to
+// tightest: ||, &&, comparisons, + -, * /, unary - !, ^ (right associative).
+class Parser
+{
+public:
+    typedef ExpressionProgram::Op Op;
+
+    Parser(const std::string& text, const std::vector<std::string>& formals,
+           std::vector<ExpressionProgram::Instruction>& code, std::vector<float>& constants)
+        : mText(text), mFormals(formals), mCode(code), mConstants(constants), mPos(0), mDepth(0)
+    {}
+
+    bool parse(std::string& error)
+    {
+        parseOr();
+        if (mError.empty() && mPos != mText.size())
+        {
+            fail("unexpected '" + mText.substr(mPos, 1) + "'");
+        }
+        error = mError;
+        return mError.empty();
+    }
+
+private:
+    void fail(const std::string& message)
+    {
+        if (mError.empty())
+        {
+            mError = message + " in expression '" + mText + "'";
+        }
+    }
+
+    bool accept(const char* token)
+    {
+        size_t length = strlen(token);
+        if (mText.compare(mPos, length, token) != 0)
+        {
+            return false;
+        }
+        mPos += length;
+        return true;
+    }
+
+    void emit(Op op, uint32_t operand = 0)
+    {
+        if (op == Op::Constant || op == Op::Param)
+        {
+            mDepth++;
+        }
+        else if (op != Op::Neg && op != Op::Not)
+        {
+            mDepth--;  // binary operators pop two and push one
+        }
+
+        if (mDepth > ExpressionProgram::k_MAX_STACK)
+        {
+            fail("too deeply nested");
+        }
+        mCode.push_back({ op, operand });
+    }
+
+    void parseOr()
+    {
+        parseAnd();
+        while (mError.empty() && accept("||"))
+        {
+            parseAnd();
+            emit(Op::Or);
+        }
+    }
+
+    void parseAnd()
+    {
+        parseComparison();
+        while (mError.empty() && accept("&&"))
+        {
+            parseComparison();
+            emit(Op::And);
+        }
+    }
+
+    void parseComparison()
+    {
+        parseAdditive();
+
+        // two-character operators first so "<=" is not read as "<"
+        static const struct
+        {
+            const char* token;
+            Op op;
+        } k_COMPARISONS[] = { { "<=", Op::LessEqual }, { ">=", Op::GreaterEqual },
+                              { "==", Op::Equal },     { "!=", Op::NotEqual },
+                              { "<", Op::Less },       { ">", Op::Greater } };
+
+        for (const auto& comparison : k_COMPARISONS)
+        {
+            if (mError.empty() && accept(comparison.token))
+            {
+                parseAdditive();
+                emit(comparison.op);
+                return;
+            }
+        }
+    }
+
+    void parseAdditive()
+    {
+        parseMultiplicative();
+        while (mError.empty())
+        {
+            if (accept("+"))
+            {
+                parseMultiplicative();
+                emit(Op::Add);
+            }
+            else if (accept("-"))
+            {
+                parseMultiplicative();
+                emit(Op::Sub);
+            }
+            else
+            {
+                break;
+            }
+        }
+    }
+
+    void parseMultiplicative()
+    {
+        parseUnary();
+        while (mError.empty())
+        {
+            if (accept("*"))
+            {
+                parseUnary();
+                emit(Op::Mul);
+            }
+            else if (accept("/"))
+            {
+                parseUnary();
+                emit(Op::Div);
+            }
+            else
+            {
+                break;
+            }
+        }
+    }
+
+    void parseUnary()
+    {
+        if (accept("-"))
+        {
+            parseUnary();
+            emit(Op::Neg);
+        }
+        else if (accept("!"))
+        {
+            parseUnary();
+            emit(Op::Not);
+        }
+        else
+        {
+            parsePower();
+        }
+    }
+
+    void parsePower()
+    {
+        parsePrimary();
+        if (mError.empty() && accept("^"))
+        {
+            parseUnary();
+            emit(Op::Pow);
+        }
+    }
+
+    void parsePrimary()
+    {
+        if (mPos >= mText.size())
+        {
+            fail("unexpected end");
+            return;
+        }
+
+        char c = mText[mPos];
+        if (accept("("))
+        {
+            parseOr();
+            if (mError.empty() && !accept(")"))
+            {
+                fail("missing ')'");
+            }
+        }
+        else if (isdigit(static_cast<unsigned char>(c)) || c == '.')
+        {
+            char* end = nullptr;
+            float value = strtof(mText.c_str() + mPos, &end);
+            mPos = end - mText.c_str();
+            emit(Op::Constant, static_cast<uint32_t>(mConstants.size()));
+            mConstants.push_back(value);
+        }
+        else if (isalpha(static_cast<unsigned char>(c)) || c == '_')
+        {
+            size_t start = mPos;
+            while (mPos < mText.size()
+                   && (isalnum(static_cast<unsigned char>(mText[mPos])) || mText[mPos] == '_'))
+            {
+                mPos++;
+            }
+
+            std::string name = mText.substr(start, mPos - start);
+            for (uint32_t i = 0; i < mFormals.size(); i++)
+            {
+                if (mFormals[i] == name)
+                {
+                    emit(Op::Param, i);
+                    return;
+                }
+            }
+            fail("unknown parameter '" + name + "'");
+        }
+        else
+        {
+            fail(std::string("unexpected '") + c + "'");
+        }
+    }
+
+    const std::string& mText;
+    const std::vector<std::string>& mFormals;
+    std::vector<ExpressionProgram::Instruction>& mCode;
+    std::vector<float>& mConstants;
+    size_t mPos;
+    int mDepth;
+    std::string mError;
+};
+}  // namespace
+
+bool ExpressionProgram::compile(const std::string& text, const std::vector<std::string>& formals,
+                                Expression& out, std::string& error)
+{
+    size_t codeSize = mCode.size();
+    size_t constantsSize = mConstants.size();
+
+    Parser parser(text, formals, mCode, mConstants);
+    if (!parser.parse(error))
+    {
+        mCode.resize(codeSize);  // drop whatever the failed parse emitted
+        mConstants.resize(constantsSize);
+        out = { 0, 0 };
+        return false;
+    }
+
+    out = { static_cast<uint32_t>(codeSize), static_cast<uint32_t>(mCode.size() - codeSize) };
+    return true;
+}
+
+float ExpressionProgram::evaluate(const Expression& expression, const float* params) const
+{
+    float stack[k_MAX_STACK];
+    int top = -1;
+
+    const Instruction* code = mCode.data() + expression.offset;
+    for (uint32_t i = 0; i < expression.length; i++)
+    {
+        const Instruction& instruction = code[i];
+        switch (instruction.op)
+        {
+            case Op::Constant: stack[++top] = mConstants[instruction.operand]; break;
+            case Op::Param: stack[++top] = params[instruction.operand]; break;
+            case Op::Neg: stack[top] = -stack[top]; break;
+            case Op::Not: stack[top] = stack[top] == 0.0f ? 1.0f : 0.0f; break;
+            default:
+            {
+                float rhs = stack[top--];
+                float& lhs = stack[top];
+                switch (instruction.op)
+                {
+                    case Op::Add: lhs = lhs + rhs; break;
+                    case Op::Sub: lhs = lhs - rhs; break;
+                    case Op::Mul: lhs = lhs * rhs; break;
+                    case Op::Div: lhs = lhs / rhs; break;
+                    case Op::Pow: lhs = powf(lhs, rhs); break;
+                    case Op::Less: lhs = lhs < rhs ? 1.0f : 0.0f; break;
+                    case Op::Greater: lhs = lhs > rhs ? 1.0f : 0.0f; break;
+                    case Op::LessEqual: lhs = lhs <= rhs ? 1.0f : 0.0f; break;
+                    case Op::GreaterEqual: lhs = lhs >= rhs ? 1.0f : 0.0f; break;
+                    case Op::Equal: lhs = lhs == rhs ? 1.0f : 0.0f; break;
+                    case Op::NotEqual: lhs = lhs != rhs ? 1.0f : 0.0f; break;
+                    case Op::And: lhs = lhs != 0.0f && rhs != 0.0f ? 1.0f : 0.0f; break;
+                    case Op::Or: lhs = lhs != 0.0f || rhs != 0.0f ? 1.0f : 0.0f; break;
+                    default: break;
+                }
+                break;
+            }
+        }
+    }
+    return top >= 0 ? stack[top] : 0.0f;
+}
+
+void ExpressionProgram::clear()
+{
+    mCode.clear();
+    mConstants.clear();
+}
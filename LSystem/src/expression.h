@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Arithmetic, comparison and logic expressions of parametric modules, such as the condition
+// "t>0" or the argument "t*0.7". Every expression is compiled once into a compact stack bytecode
+// that evaluates against a module's parameters without reparsing any text.
+class ExpressionProgram
+{
+public:
+    struct Expression
+    {
+        uint32_t offset;  // into the instruction buffer
+        uint32_t length;  // 0 for an absent expression, such as a production without a condition
+    };
+
+    // Identifiers in text refer to formals by position. On failure out is left empty and error
+    // describes the problem.
+    bool compile(const std::string& text, const std::vector<std::string>& formals, Expression& out,
+                 std::string& error);
+
+    // params holds at least as many values as the formals the expression was compiled against
+    float evaluate(const Expression& expression, const float* params) const;
+
+    void clear();
+
+    static constexpr int k_MAX_STACK = 32;
+
+    enum class Op : uint8_t
+    {
+        Constant,
+        Param,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        Pow,
+        Neg,
+        Not,
+        Less,
+        Greater,
+        LessEqual,
+        GreaterEqual,
+        Equal,
+        NotEqual,
+        And,
+        Or
+    };
+
+    struct Instruction
+    {
+        Op op;
+        uint32_t operand;  // constant or parameter index
+    };
+
+private:
+    std::vector<Instruction> mCode;
+    std::vector<float> mConstants;
+};
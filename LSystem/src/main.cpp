@@ -12,7 +12,7 @@ int main(int argc, char** argv)
     for (int i = 0; i < 2; i++)
     {
         std::string insn = system.getIteration(i);
-        std::cout << insn << std::endl;
+        std::cout << system.toText(insn) << std::endl;
 
         std::vector<LSystem::Branch> branches;
         system.process(i, branches);
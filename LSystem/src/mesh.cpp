@@ -0,0 +1,370 @@
+#include "mesh.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include "parallel.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace
+{
+// Chains a worker meshes at a time, enough to amortize handing out the range
+constexpr size_t k_TASK_CHAINS = 1024;
+
+struct Axis
+{
+    float x, y, z;
+};
+
+Axis cross(const Axis& a, const Axis& b)
+{
+    return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x };
+}
+
+Axis normalize(const Axis& a)
+{
+    float length = sqrtf(a.x * a.x + a.y * a.y + a.z * a.z);
+    return length > 0.0f ? Axis{ a.x / length, a.y / length, a.z / length } : a;
+}
+
+float dot(const Axis& a, const Axis& b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+Axis direction(const LSystem::BranchBuffers& branches, size_t b)
+{
+    return normalize({ branches.endX[b] - branches.startX[b], branches.endY[b] - branches.startY[b],
+                       branches.endZ[b] - branches.startZ[b] });
+}
+
+void writePoint(float* point, const Axis& center, const Axis& offset)
+{
+    point[0] = center.x + offset.x;
+    point[1] = center.y + offset.y;
+    point[2] = center.z + offset.z;
+    point[3] = 1.0f;
+}
+
+// The ring lies in the plane of left and up, both perpendicular to the branch. Left is taken
+// from the world z axis, or from the y axis for a branch too close to vertical for that.
+void frame(const Axis& forward, Axis& left, Axis& up)
+{
+    left = cross({ 0.0f, 0.0f, 1.0f }, forward);
+    if (left.x * left.x + left.y * left.y < 0.0001f * 0.0001f)
+    {
+        up = normalize(cross(forward, { 0.0f, 1.0f, 0.0f }));
+        left = cross(up, forward);
+    }
+    else
+    {
+        left = normalize(left);
+        up = cross(forward, left);
+    }
+}
+
+#ifdef __AVX2__
+// Stores eight consecutive points, transposing the lanes of x, y and z into x, y, z, 1
+void storePoints8(float* points, __m256 x, __m256 y, __m256 z)
+{
+    __m256 w = _mm256_set1_ps(1.0f);
+    __m256 xy0 = _mm256_unpacklo_ps(x, y);  // lanes 0, 1 and 4, 5
+    __m256 xy1 = _mm256_unpackhi_ps(x, y);  // lanes 2, 3 and 6, 7
+    __m256 zw0 = _mm256_unpacklo_ps(z, w);
+    __m256 zw1 = _mm256_unpackhi_ps(z, w);
+    __m256 lanes[4] = { _mm256_shuffle_ps(xy0, zw0, 0x44), _mm256_shuffle_ps(xy0, zw0, 0xEE),
+                        _mm256_shuffle_ps(xy1, zw1, 0x44), _mm256_shuffle_ps(xy1, zw1, 0xEE) };
+    for (int lane = 0; lane < 4; lane++)
+    {
+        _mm_storeu_ps(points + 4 * lane, _mm256_castps256_ps128(lanes[lane]));
+        _mm_storeu_ps(points + 4 * (lane + 4), _mm256_extractf128_ps(lanes[lane], 1));
+    }
+}
+#endif
+
+// With AVX2 and vectorized, eight sides at a time come from the ring template, the rest one by
+// one. Both paths round the same products and sums, so they agree up to contraction into FMAs.
+void writeRing(const Axis& center, const Axis& left, const Axis& up, int sides,
+               const float* cosines, const float* sines, bool vectorized, float* points)
+{
+    int i = 0;
+#ifdef __AVX2__
+    for (; vectorized && i + 8 <= sides; i += 8)
+    {
+        __m256 c = _mm256_loadu_ps(cosines + i);
+        __m256 s = _mm256_loadu_ps(sines + i);
+        auto coordinate = [&](float center, float left, float up)
+        {
+            __m256 offset = _mm256_add_ps(_mm256_mul_ps(c, _mm256_set1_ps(left)),
+                                          _mm256_mul_ps(s, _mm256_set1_ps(up)));
+            return _mm256_add_ps(_mm256_set1_ps(center), offset);
+        };
+        storePoints8(points + 4 * i, coordinate(center.x, left.x, up.x),
+                     coordinate(center.y, left.y, up.y), coordinate(center.z, left.z, up.z));
+    }
+#else
+    (void)vectorized;
+#endif
+    for (; i < sides; i++)
+    {
+        Axis offset = { cosines[i] * left.x + sines[i] * up.x,
+                        cosines[i] * left.y + sines[i] * up.y,
+                        cosines[i] * left.z + sines[i] * up.z };
+        writePoint(points + 4 * i, center, offset);
+    }
+}
+
+// Faces of a tube of the given segments whose vertices start at base: its rings in order, then
+// the start and end cap centers. Faces are the start cap facing back, the end cap facing forward,
+// then the side quads of each segment.
+void writeTubeFaces(int base, size_t segments, int sides, int* counts, int* connects)
+{
+    int centers = base + static_cast<int>(segments + 1) * sides;
+    int last = base + static_cast<int>(segments) * sides;
+    int* start = connects;
+    int* end = start + 3 * sides;
+    for (int i = 0; i < sides; i++)
+    {
+        int next = i + 1 < sides ? i + 1 : 0;
+        counts[i] = 3;
+        counts[sides + i] = 3;
+
+        start[3 * i] = centers;
+        start[3 * i + 1] = base + next;
+        start[3 * i + 2] = base + i;
+
+        end[3 * i] = centers + 1;
+        end[3 * i + 1] = last + i;
+        end[3 * i + 2] = last + next;
+    }
+
+    counts += 2 * sides;
+    int* side = end + 3 * sides;
+    for (size_t s = 0; s < segments; s++)
+    {
+        int ring = base + static_cast<int>(s) * sides;
+        for (int i = 0; i < sides; i++)
+        {
+            int next = i + 1 < sides ? i + 1 : 0;
+            *counts++ = 4;
+            side[0] = ring + i;
+            side[1] = ring + next;
+            side[2] = ring + sides + next;
+            side[3] = ring + sides + i;
+            side += 4;
+        }
+    }
+}
+
+// Rings of the chain of branches first to last - 1. A joint's ring is perpendicular to the mean
+// of the two directions meeting there, and its frame is carried over from the previous ring by
+// removing the part along the new direction, so the tube does not twist along the chain. A ring
+// facing the same way as the one before keeps its frame as is, so a chain of one branch is the
+// plain cylinder of frame().
+void writeTube(const LSystem::BranchBuffers& branches, size_t first, size_t last, int sides,
+               const float* cosines, const float* sines, bool vectorized, float* points)
+{
+    size_t segments = last - first;
+    Axis start = { branches.startX[first], branches.startY[first], branches.startZ[first] };
+    Axis forward = direction(branches, first);
+    Axis left, up;
+    frame(forward, left, up);
+    Axis facing = forward;  // of the latest ring
+    writeRing(start, left, up, sides, cosines, sines, vectorized, points);
+    writePoint(points + 4 * (segments + 1) * sides, start, { 0.0f, 0.0f, 0.0f });
+
+    for (size_t b = first; b < last; b++)
+    {
+        Axis tangent = forward;
+        if (b + 1 < last)
+        {
+            Axis next = direction(branches, b + 1);
+            Axis mean = { forward.x + next.x, forward.y + next.y, forward.z + next.z };
+            tangent = dot(mean, mean) > 0.0001f ? normalize(mean) : next;
+            forward = next;
+        }
+
+        float along = dot(left, tangent);
+        Axis carried = { left.x - along * tangent.x, left.y - along * tangent.y,
+                         left.z - along * tangent.z };
+        if (tangent.x == facing.x && tangent.y == facing.y && tangent.z == facing.z)
+        {
+            // straight on, the frame already fits
+        }
+        else if (dot(carried, carried) < 0.0001f * 0.0001f)
+        {
+            frame(tangent, left, up);  // turned back on itself
+        }
+        else
+        {
+            left = normalize(carried);
+            up = cross(tangent, left);
+        }
+        facing = tangent;
+
+        Axis end = { branches.endX[b], branches.endY[b], branches.endZ[b] };
+        writeRing(end, left, up, sides, cosines, sines, vectorized,
+                  points + 4 * (b - first + 1) * sides);
+        if (b + 1 == last)
+        {
+            writePoint(points + 4 * ((segments + 1) * sides + 1), end, { 0.0f, 0.0f, 0.0f });
+        }
+    }
+}
+
+}  // namespace
+
+MeshBuilder::MeshBuilder(float radius)
+    : mThreadCount(resolveThreadCount(0)), mVectorized(true), mSidesPolicy(SidesPolicy::Fixed),
+      mSides(k_SLICES), mMaxTriangles(0)
+{
+    for (int sides = k_MIN_SIDES; sides <= k_MAX_SIDES; sides++)
+    {
+        for (int i = 0; i < sides; i++)
+        {
+            double angle = 2.0 * M_PI * i / sides;
+            mRingCos[ringOffset(sides) + i] = static_cast<float>(radius * cos(angle));
+            mRingSin[ringOffset(sides) + i] = static_cast<float>(radius * sin(angle));
+        }
+    }
+}
+
+void MeshBuilder::setThreadCount(unsigned int threads)
+{
+    mThreadCount = resolveThreadCount(threads);
+}
+
+void MeshBuilder::setVectorized(bool enable)
+{
+    mVectorized = enable;
+}
+
+void MeshBuilder::setSides(SidesPolicy policy, int sides, uint64_t maxTriangles)
+{
+    mSidesPolicy = policy;
+    mSides = std::min(std::max(sides, k_MIN_SIDES), k_MAX_SIDES);
+    mMaxTriangles = maxTriangles;
+}
+
+void MeshBuilder::chooseSides(const LSystem::BranchBuffers& branches,
+                              const std::vector<size_t>& chains, std::vector<uint8_t>& sides) const
+{
+    size_t numChains = chains.size() - 1;
+    sides.assign(numChains, static_cast<uint8_t>(mSides));
+    if (mSidesPolicy == SidesPolicy::Fixed)
+    {
+        return;
+    }
+
+    if (mSidesPolicy == SidesPolicy::Depth)
+    {
+        // without recorded depths every chain is at depth 0
+        for (size_t c = 0; c < numChains && !branches.depth.empty(); c++)
+        {
+            int depth = branches.depth[chains[c]];
+            sides[c] = static_cast<uint8_t>(std::max(mSides / (depth + 1), k_MIN_SIDES));
+        }
+        return;
+    }
+
+    std::vector<float> lengths(numChains);
+    float longest = 0.0f;
+    float shortest = FLT_MAX;  // of those with any length
+    for (size_t c = 0; c < numChains; c++)
+    {
+        for (size_t b = chains[c]; b < chains[c + 1]; b++)
+        {
+            float x = branches.endX[b] - branches.startX[b];
+            float y = branches.endY[b] - branches.startY[b];
+            float z = branches.endZ[b] - branches.startZ[b];
+            lengths[c] += sqrtf(x * x + y * y + z * z);
+        }
+        longest = std::max(longest, lengths[c]);
+        shortest = lengths[c] > 0.0f ? std::min(shortest, lengths[c]) : shortest;
+    }
+    if (longest <= 0.0f)
+    {
+        return;
+    }
+
+    // Sides in proportion to length, with scale sides for the longest chain. Returns the triangles.
+    auto assign = [&](double scale)
+    {
+        uint64_t triangles = 0;
+        for (size_t c = 0; c < numChains; c++)
+        {
+            double proportional = std::round(scale * lengths[c] / longest);
+            sides[c] = static_cast<uint8_t>(
+                std::min(std::max(proportional, double(k_MIN_SIDES)), double(k_MAX_SIDES)));
+            triangles += 2 * uint64_t(sides[c]) * (chains[c + 1] - chains[c] + 1);
+        }
+        return triangles;
+    };
+
+    if (mSidesPolicy == SidesPolicy::Length || mMaxTriangles == 0)
+    {
+        assign(mSides);
+        return;
+    }
+
+    // The triangle count only grows with the scale, so bisect for the largest one that fits. A
+    // budget below even the fewest sides everywhere gets those.
+    double low = 0.0;
+    double high = k_MAX_SIDES * double(longest) / shortest;  // every chain at the most sides
+    if (assign(high) > mMaxTriangles)
+    {
+        for (int step = 0; step < 40; step++)
+        {
+            double middle = 0.5 * (low + high);
+            if (assign(middle) <= mMaxTriangles)
+            {
+                low = middle;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+        assign(low);
+    }
+}
+
+void MeshBuilder::buildTubes(const LSystem::BranchBuffers& branches, Mesh& mesh) const
+{
+    std::vector<size_t> chains;
+    branches.findChains(chains);
+    std::vector<uint8_t> sides;
+    chooseSides(branches, chains, sides);
+
+    // A chain of k branches with s sides has k + 1 rings and two cap centers, two caps of s
+    // triangles and k rings of s quads. Offsets of every chain are summed up front.
+    size_t numChains = chains.size() - 1;
+    std::vector<size_t> vertices(numChains + 1), faces(numChains + 1), indices(numChains + 1);
+    for (size_t c = 0; c < numChains; c++)
+    {
+        size_t segments = chains[c + 1] - chains[c];
+        vertices[c + 1] = vertices[c] + (segments + 1) * sides[c] + 2;
+        faces[c + 1] = faces[c] + (segments + 2) * sides[c];
+        indices[c + 1] = indices[c] + (4 * segments + 6) * sides[c];
+    }
+    mesh.points.resize(vertices[numChains] * 4);
+    mesh.faceCounts.resize(faces[numChains]);
+    mesh.faceConnects.resize(indices[numChains]);
+
+    size_t numTasks = (numChains + k_TASK_CHAINS - 1) / k_TASK_CHAINS;
+    parallelFor(numTasks, mThreadCount, [&](size_t task)
+                {
+                    size_t last = std::min(numChains, (task + 1) * k_TASK_CHAINS);
+                    for (size_t c = task * k_TASK_CHAINS; c < last; c++)
+                    {
+                        writeTubeFaces(static_cast<int>(vertices[c]), chains[c + 1] - chains[c],
+                                       sides[c], mesh.faceCounts.data() + faces[c],
+                                       mesh.faceConnects.data() + indices[c]);
+                        writeTube(branches, chains[c], chains[c + 1], sides[c],
+                                  mRingCos + ringOffset(sides[c]), mRingSin + ringOffset(sides[c]),
+                                  mVectorized, mesh.points.data() + vertices[c] * 4);
+                    }
+                });
+}
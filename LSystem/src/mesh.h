@@ -0,0 +1,71 @@
+#pragma once
+
+#include <vector>
+#include "LSystem.h"
+
+// Tube meshes of a whole plant, built in one batch. Every unbranched run of branches, like the
+// trunk F->FF grows, is welded into one tube sharing a ring at each joint, with caps only at the
+// two ends of the run. Each tube has its own number of sides, picked by a policy so the triangles
+// go where the plant is largest.
+//
+// Every output array is sized exactly before it is filled, the topology comes from closed-form
+// indices and the positions are written in a single pass over the chains, so nothing grows per
+// branch. Chains are meshed in ranges spread over the worker threads, each writing at offsets
+// that follow from its first chain. Built with AVX2, eight sides of a ring are computed at once.
+// The arrays are plain floats and ints, which keeps the builder independent of Maya.
+class MeshBuilder
+{
+public:
+    static constexpr int k_SLICES = 10;
+    static constexpr int k_MIN_SIDES = 3;  // of a tube
+    static constexpr int k_MAX_SIDES = 32;
+
+    // How buildTubes() picks the sides of a tube, which all its rings share
+    enum class SidesPolicy
+    {
+        Fixed,   // the same sides for every tube
+        Depth,   // sides at bracket depth 0, divided by one more at every level; needs depths
+        Length,  // sides for the longest tube, fewer in proportion for shorter ones
+        Budget   // in proportion to length, as many as keep the plant within maxTriangles, or
+                 // like Length when that is 0
+    };
+
+    // Vertices are stored as x, y, z, 1, the layout Maya's float point arrays copy from. Arrays
+    // keep their capacity, so rebuilding a mesh of the same size allocates nothing.
+    struct Mesh
+    {
+        std::vector<float> points;
+        std::vector<int> faceCounts;
+        std::vector<int> faceConnects;
+
+        int numVertices() const { return static_cast<int>(points.size() / 4); }
+        int numFaces() const { return static_cast<int>(faceCounts.size()); }
+    };
+
+    explicit MeshBuilder(float radius = 0.25f);
+
+    void setThreadCount(unsigned int threads);  // 0 uses every hardware thread
+    void setSides(SidesPolicy policy, int sides = k_SLICES, uint64_t maxTriangles = 0);
+    void setVectorized(bool enable);  // off computes rings one side at a time even with AVX2
+
+    // Chains as BranchBuffers::findChains() finds them. A chain of k branches with s sides takes
+    // (k + 1)s + 2 vertices and (k + 2)s faces, so a lone branch of 10 sides takes 22 and 30.
+    // Vertex indices are ints, as Maya takes them.
+    void buildTubes(const LSystem::BranchBuffers& branches, Mesh& mesh) const;
+
+private:
+    // Rings of every number of sides, one after the other from k_MIN_SIDES up
+    static constexpr int k_RING_VALUES = (k_MAX_SIDES + 1) * k_MAX_SIDES / 2 - 3;
+    static constexpr int ringOffset(int sides) { return sides * (sides - 1) / 2 - 3; }
+
+    void chooseSides(const LSystem::BranchBuffers& branches, const std::vector<size_t>& chains,
+                     std::vector<uint8_t>& sides) const;
+
+    float mRingCos[k_RING_VALUES];  // unit rings scaled by the radius
+    float mRingSin[k_RING_VALUES];
+    unsigned int mThreadCount;
+    bool mVectorized;
+    SidesPolicy mSidesPolicy;
+    int mSides;
+    uint64_t mMaxTriangles;
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// Number of worker threads to use when a thread count of 0 ("automatic") is requested
+inline unsigned int resolveThreadCount(unsigned int threads)
+{
+    if (threads == 0)
+    {
+        threads = std::thread::hardware_concurrency();
+    }
+    return threads == 0 ? 1 : threads;
+}
+
+// Runs fn(i) for every i in [0, count), spreading the tasks over at most `threads` threads.
+// The calling thread works on tasks too, so a single thread never spawns anything.
+template <typename Fn>
+void parallelFor(size_t count, unsigned int threads, Fn&& fn)
+{
+    size_t workers = threads < count ? threads : count;
+    if (workers <= 1)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            fn(i);
+        }
+        return;
+    }
+
+    auto work = [&](size_t first)
+    {
+        for (size_t i = first; i < count; i += workers)
+        {
+            fn(i);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(workers - 1);
+    for (size_t w = 1; w < workers; w++)
+    {
+        pool.emplace_back(work, w);
+    }
+    work(0);
+
+    for (std::thread& thread : pool)
+    {
+        thread.join();
+    }
+}
@@ -0,0 +1,324 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "LSystem.h"
+#include "mesh.h"
+
+// Headless checks of the core, run by ctest. Each check prints what failed and the exit code is
+// the number of failures.
+#define CHECK(condition)                                                               \
+    do                                                                                 \
+    {                                                                                  \
+        if (!(condition))                                                              \
+        {                                                                              \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);      \
+            gFailures++;                                                               \
+        }                                                                              \
+    } while (0)
+
+namespace
+{
+int gFailures = 0;
+
+// Rewrites long enough to be split into chunks give the same string as a serial rewrite
+void checkParallelRewrite()
+{
+    const char* grammars[] = { "F\nF->F[+F]F[-F]F",
+                               "F\nF-(0.5)->F[+F]F[-F]F\nF-(0.5)->F[-F]F[+F]F" };
+    for (const char* grammar : grammars)
+    {
+        LSystem serial;
+        serial.loadProgramFromString(grammar);
+        serial.setThreadCount(1);
+        LSystem parallel;
+        parallel.loadProgramFromString(grammar);
+        parallel.setThreadCount(4);
+
+        CHECK(serial.getIteration(8).size() >= (1u << 20));  // past the size that goes parallel
+        CHECK(parallel.getIteration(9) == serial.getIteration(9));
+    }
+}
+
+// A compressed view made before a reload notices it instead of reading the new grammar's tables
+void checkCompressedReload()
+{
+    LSystem system;
+    system.loadProgramFromString("F\nF->F[+F]F[-F]F");
+    LSystem::CompressedIteration view = system.getCompressedIteration(6);
+    CHECK(view.valid());
+    CHECK(view.length() == system.getIteration(6).size());
+    CHECK(view[view.length() - 1] == system.getIteration(6).back());
+
+    system.loadProgramFromString("F\nF->FF");
+    CHECK(!view.valid());
+    CHECK(view.length() == 0);
+    CHECK(view[0] == '\0');
+}
+
+// Grammars whose iterations the view cannot index say so, and the stream either gives the
+// iteration or nothing
+void checkCompressedKinds()
+{
+    const char* grammars[] = { "F\nF-(0.5)->F[+F]F[-F]F\nF-(0.5)->F", "baaaaaaa\nb<a->b\nb->a",
+                               "A(1)\nA(t):t<12->F(2/t)[+A(t+1)][-A(t+1)]" };
+    for (const char* grammar : grammars)
+    {
+        LSystem system;
+        system.loadProgramFromString(grammar);
+        LSystem::CompressedIteration view = system.getCompressedIteration(4);
+        CHECK(!view.valid());
+        CHECK(view.length() == 0);
+        CHECK(view[0] == '\0');
+
+        std::string streamed;
+        LSystem::DerivationStream stream = view.stream();
+        for (char sym; stream.next(sym);)
+        {
+            streamed += sym;
+        }
+        CHECK(streamed.empty() || streamed == system.getIteration(4));
+    }
+}
+
+// A command for a name the grammar only uses in a successor takes effect when it is registered
+void checkRegisteredName()
+{
+    LSystem system;
+    system.loadProgramFromString("X\nX->F[+bud]F");
+    std::vector<LSystem::Branch> branches;
+    system.process(0, branches);
+    CHECK(branches.size() == 2);  // b, u and d are models
+
+    CHECK(system.registerCommand("bud", LSystem::TurtleOp::Draw));
+    CHECK(system.getIteration(0).size() == 6);
+    branches.clear();
+    system.process(0, branches);
+    CHECK(branches.size() == 3);
+
+    CHECK(!system.registerCommand("b(u)d", LSystem::TurtleOp::Draw));
+    CHECK(system.getIteration(0).size() == 6);
+}
+
+// Predicted counts match what the turtle draws
+void checkGrowth()
+{
+    LSystem system;
+    system.loadProgramFromString("F\nF->F[+F]F[-F]F");
+    LSystem::GrowthStats stats = system.analyzeGrowth(3);
+    std::vector<LSystem::Branch> branches;
+    system.process(3, branches);
+    CHECK(stats.exact && stats.branches == branches.size());
+    CHECK(stats.vertices == branches.size() * LSystem::k_VERTICES_PER_BRANCH);
+    CHECK(stats.symbols == system.getIteration(3).size());
+}
+
+// An iteration that a budget stop left in the rewrite buffer is returned whole when asked for
+void checkBudgetStop()
+{
+    const char* grammar = "X\nX->F[+X]F[-X]+X\nF->FF";
+    LSystem unlimited;
+    unlimited.loadProgramFromString(grammar);
+    size_t expected = unlimited.getIteration(4).size();
+
+    for (LSystem::CachePolicy policy :
+         { LSystem::CachePolicy::KeepLatest, LSystem::CachePolicy::ByteBudget })
+    {
+        LSystem system;
+        system.loadProgramFromString(grammar);
+        system.setCachePolicy(policy, 1);
+        system.setBudget({ expected * 3, 0, 0 });  // iteration 4 fits, 5 does not
+
+        const std::string& deepest = system.getIteration(8);
+        CHECK(system.getLastResult().status == LSystem::Status::SymbolLimit);
+        CHECK(system.getLastResult().iteration == 4);
+        CHECK(deepest.size() == expected);
+        CHECK(system.getIteration(4).size() == expected);
+        CHECK(system.getLastResult().ok());
+    }
+}
+
+// A branch count past its prediction stops at the limit, in the iteration that was drawing
+void checkBranchStop()
+{
+    LSystem system;
+    system.loadProgramFromString("F\nF-(0.3)->F[+F]F[-F]F\nF-(0.7)->FF");
+    std::vector<LSystem::Branch> branches;
+    system.process(4, branches);
+    size_t drawn = branches.size();
+    CHECK(system.analyzeGrowth(4).branches < 300 && drawn > 300);  // passes the prediction
+
+    system.setBudget({ 0, 300, 0 });
+    branches.clear();
+    LSystem::Result result = system.process(4, branches);
+    CHECK(result.status == LSystem::Status::BranchLimit);
+    CHECK(result.iteration == 4 && result.truncated);
+    CHECK(branches.size() == 300);
+}
+
+// A parametric rewrite over the symbol budget is refused whole, keeping the one before
+void checkParametricBudget()
+{
+    const char* grammar = "A(1)\nA(t):t<12->F(2/t)[+A(t+1)][-A(t+1)]";
+    LSystem unlimited;
+    unlimited.loadProgramFromString(grammar);
+    LSystem::ModuleString expected = unlimited.getModules(5);
+
+    LSystem system;
+    system.loadProgramFromString(grammar);
+    system.setBudget({ expected.symbols.size(), 0, 0 });
+    const LSystem::ModuleString& modules = system.getModules(8);
+    CHECK(system.getLastResult().status == LSystem::Status::SymbolLimit);
+    CHECK(system.getLastResult().iteration == 5);
+    CHECK(modules.symbols == expected.symbols && modules.params == expected.params);
+    CHECK(modules.paramOffsets == expected.paramOffsets);
+}
+
+// A reload that lengthens the kept iterations stops where a fresh load of the edit would
+void checkBudgetReload()
+{
+    LSystem::Budget budget = { 1000000, 0, 0 };
+    LSystem fresh;
+    fresh.loadProgramFromString("F\nF->FFFFFF");
+    fresh.setBudget(budget);
+    size_t expected = fresh.getIteration(7).size();
+
+    LSystem system;
+    system.loadProgramFromString("F\nF->F[+F]F[-F]F");
+    CHECK(system.getIteration(7).size() < budget.maxSymbols);  // kept for the reload
+    system.setBudget(budget);
+    system.loadProgramFromString("F\nF->FFFFFF");
+    CHECK(system.getIteration(7).size() == expected);
+    CHECK(system.getLastResult().status == fresh.getLastResult().status);
+    CHECK(system.getLastResult().iteration == fresh.getLastResult().iteration);
+}
+
+// Keeping a smaller share of the leaves draws fewer branches, also when the innermost brackets
+// only hold the non-drawing apex
+void checkLeafFraction()
+{
+    const char* grammars[] = { "X\nX->F[+X][-X]FX", "A(1)\nA(t):t<12->F(2/t)[+A(t+1)][-A(t+1)]" };
+    for (const char* grammar : grammars)
+    {
+        LSystem system;
+        system.loadProgramFromString(grammar);
+        size_t previous = SIZE_MAX;
+        for (float fraction : { 1.0f, 0.5f, 0.1f })
+        {
+            system.setDetail({ vec3(0, 0, 0), 0.0f, 0, fraction });
+            std::vector<LSystem::Branch> branches;
+            system.process(8, branches);
+            CHECK(branches.size() < previous);
+            previous = branches.size();
+        }
+    }
+}
+
+// Flattening the instanced hierarchy keeps the draw order, so it welds and merges into as few
+// chains as the turtle's own output does
+void checkInstancedChains()
+{
+    const char* grammars[] = { "X\nX->F[+X]F[-X]+X\nF->FF", "X\nX->F[+X][-X]FX\nF->FF",
+                               "X\nX->F-[[X]+X]+F[+FX]-X\nF->FF" };
+    for (const char* grammar : grammars)
+    {
+        LSystem system;
+        system.loadProgramFromString(grammar);
+        LSystem::BranchBuffers drawn, flattened, drawnMerged, flattenedMerged;
+        system.process(5, drawn);
+        LSystem::InstanceHierarchy hierarchy;
+        CHECK(system.process(5, hierarchy));
+        hierarchy.flatten(flattened);
+
+        std::vector<size_t> drawnChains, flattenedChains;
+        drawn.findChains(drawnChains);
+        flattened.findChains(flattenedChains);
+        CHECK(flattened.size() == drawn.size());
+        CHECK(drawnChains.size() < drawn.size());  // something to weld
+        CHECK(flattenedChains == drawnChains);
+
+        drawn.mergeCollinear(5.0f, drawnMerged);
+        flattened.mergeCollinear(5.0f, flattenedMerged);
+        CHECK(flattenedMerged.size() == drawnMerged.size());
+    }
+}
+
+// Rings computed eight sides at a time match the ones computed side by side, for every number of
+// sides the builder takes
+void checkVectorizedTubes()
+{
+    LSystem system;
+    system.loadProgramFromString("X\nX->F[+X][-X]FX\nF->FF");
+    LSystem::BranchBuffers branches;
+    system.process(5, branches);
+
+    for (int sides :
+         { MeshBuilder::k_MIN_SIDES, MeshBuilder::k_SLICES, 17, MeshBuilder::k_MAX_SIDES })
+    {
+        MeshBuilder builder;
+        builder.setSides(MeshBuilder::SidesPolicy::Fixed, sides);
+        MeshBuilder::Mesh vectorized, scalar;
+        builder.buildTubes(branches, vectorized);
+        builder.setVectorized(false);
+        builder.buildTubes(branches, scalar);
+
+        CHECK(vectorized.faceCounts == scalar.faceCounts);
+        CHECK(vectorized.faceConnects == scalar.faceConnects);
+        CHECK(vectorized.points.size() == scalar.points.size());
+        float largest = 0.0f;
+        for (size_t i = 0; i < vectorized.points.size() && i < scalar.points.size(); i++)
+        {
+            largest = std::max(largest, std::fabs(vectorized.points[i] - scalar.points[i]));
+        }
+        CHECK(largest < 1e-4f);
+    }
+}
+
+// A lone branch is a cylinder, its end ring the start ring moved along the branch
+void checkLoneBranch()
+{
+    LSystem system;
+    system.loadProgramFromString("F\nF->F");
+    LSystem::BranchBuffers branches;
+    system.process(1, branches);
+    MeshBuilder builder;
+    MeshBuilder::Mesh mesh;
+    builder.buildTubes(branches, mesh);
+
+    int sides = MeshBuilder::k_SLICES;
+    CHECK(mesh.numVertices() == 2 * sides + 2);
+    CHECK(mesh.numFaces() == 3 * sides);
+    float along[3] = { branches.endX[0] - branches.startX[0], branches.endY[0] - branches.startY[0],
+                       branches.endZ[0] - branches.startZ[0] };
+    for (int i = 0; i < sides && mesh.numVertices() == 2 * sides + 2; i++)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float moved = mesh.points[4 * (sides + i) + axis] - mesh.points[4 * i + axis];
+            CHECK(std::fabs(moved - along[axis]) < 1e-6f);
+        }
+    }
+}
+}  // namespace
+
+int main(int, char**)
+{
+    checkParallelRewrite();
+    checkCompressedReload();
+    checkCompressedKinds();
+    checkRegisteredName();
+    checkGrowth();
+    checkBudgetStop();
+    checkBudgetReload();
+    checkBranchStop();
+    checkParametricBudget();
+    checkLeafFraction();
+    checkInstancedChains();
+    checkVectorizedTubes();
+    checkLoneBranch();
+
+    printf("%s: %d failed\n", gFailures == 0 ? "ok" : "FAILED", gFailures);
+    return gFailures;
+}
@@ -22,6 +22,9 @@ constexpr const char k_GRAMMAR_LONG[] = "-grammar";
 constexpr const char k_ITERATIONS_SHORT[] = "-it";
 constexpr const char k_ITERATIONS_LONG[] = "-iterations";
 
+constexpr const char k_SEED_SHORT[] = "-sd";
+constexpr const char k_SEED_LONG[] = "-seed";
+
 constexpr const char k_CMD_FORMAT[]
     = R"(curve -d 1 -p {0} {1} {2} -p {3} {4} {5} -k 0 -k 1 -name "curve{6}";
 circle -radius 0.1 -nr {7} {8} {9} -c {0} {1} {2} -name "nurbsCircle{6}";
@@ -35,6 +38,7 @@ static MSyntax getSyntax()
     syntax.addFlag(k_ANGLE_SHORT, k_ANGLE_LONG, MSyntax::kDouble);
     syntax.addFlag(k_GRAMMAR_SHORT, k_GRAMMAR_LONG, MSyntax::kString);
     syntax.addFlag(k_ITERATIONS_SHORT, k_ITERATIONS_LONG, MSyntax::kLong);
+    syntax.addFlag(k_SEED_SHORT, k_SEED_LONG, MSyntax::kLong);
     return syntax;
 }
 
@@ -50,6 +54,11 @@ MStatus LSystemCmd::createGeometry()
     mSystem.loadProgramFromString(mGrammar);
     mSystem.setDefaultAngle(mAngle);
     mSystem.setDefaultStep(mStepSize);
+    mSystem.setSeed(static_cast<uint32_t>(mSeed));
+    for (const std::string& error : mSystem.getErrors())
+    {
+        MGlobal::displayWarning(MString("Grammar: ") + error.c_str());
+    }
 
     mBranches.clear();
     mSystem.process(this->mIterations, mBranches);
@@ -106,6 +115,10 @@ MStatus LSystemCmd::doIt(const MArgList& args)
     {
         argData.getFlagArgument(k_ITERATIONS_LONG, 0, mIterations);
     }
+    if (argData.isFlagSet(k_SEED_LONG))
+    {
+        argData.getFlagArgument(k_SEED_LONG, 0, mSeed);
+    }
 
     return this->createGeometry();
 }
\ No newline at end of file
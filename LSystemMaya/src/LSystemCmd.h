@@ -24,6 +24,7 @@ public:
     double mStepSize = 22.5;
     double mAngle = 1.0;
     int32_t mIterations = 3;
+    int32_t mSeed = 0;
 
 private:
     LSystem mSystem;
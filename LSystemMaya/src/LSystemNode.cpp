@@ -5,14 +5,16 @@
 #include <fstream>
 
 #include <maya/MPoint.h>
+#include <maya/MFloatPointArray.h>
+#include <maya/MIntArray.h>
 #include <maya/MTime.h>
 #include <maya/MFnUnitAttribute.h>
 #include <maya/MFnTypedAttribute.h>
 #include <maya/MFnNumericAttribute.h>
+#include <maya/MFnEnumAttribute.h>
 #include <maya/MFnStringData.h>
 #include <maya/MFnMeshData.h>
 
-#include "cylinder.h"
 #include "macros.h"
 
 const MTypeId LSystemNode::kNodeId{ 0x24681050 }; // random hex code ID
@@ -22,6 +24,19 @@ MObject LSystemNode::sOutputMeshAttr;
 
 MObject LSystemNode::sAngleAttr;
 MObject LSystemNode::sStepSizeAttr;
+MObject LSystemNode::sSeedAttr;
+MObject LSystemNode::sMaxSymbolsAttr;
+MObject LSystemNode::sMaxBranchesAttr;
+MObject LSystemNode::sMaxMemoryAttr;
+MObject LSystemNode::sMaxDepthAttr;
+MObject LSystemNode::sLeafFractionAttr;
+MObject LSystemNode::sMinProjectedLengthAttr;
+MObject LSystemNode::sLodEyeAttr;
+MObject LSystemNode::sMergeAngleAttr;
+MObject LSystemNode::sSidesAttr;
+MObject LSystemNode::sMaxTrianglesAttr;
+
+MObject LSystemNode::sSidesPolicyAttr;
 
 MObject LSystemNode::sTimeAttr;
 
@@ -39,6 +54,46 @@ MStatus LSystemNode::initialize()
     numericAttr.setCached(true);
     sStepSizeAttr = numericAttr.create("stepSize", "ss", MFnNumericData::kDouble, 22.5);
     sAngleAttr = numericAttr.create("angle", "ag", MFnNumericData::kDouble, 5.0);
+    sSeedAttr = numericAttr.create("seed", "sd", MFnNumericData::kInt, 0);
+
+    // derivation budget, 0 for no limit; over it the deepest iteration that fits is shown
+    sMaxSymbolsAttr = numericAttr.create("maxSymbols", "msy", MFnNumericData::kInt, 200000000);
+    numericAttr.setMin(0);
+    sMaxBranchesAttr = numericAttr.create("maxBranches", "mbr", MFnNumericData::kInt, 5000000);
+    numericAttr.setMin(0);
+    sMaxMemoryAttr = numericAttr.create("maxMemory", "mmem", MFnNumericData::kInt, 4096); // MB
+    numericAttr.setMin(0);
+
+    // level of detail, 0 for off; connect the camera's translate to lodEye for projected lengths
+    sMaxDepthAttr = numericAttr.create("maxDepth", "mdp", MFnNumericData::kInt, 0);
+    numericAttr.setMin(0);
+    sLeafFractionAttr = numericAttr.create("leafFraction", "lfr", MFnNumericData::kDouble, 1.0);
+    numericAttr.setMin(0.0);
+    numericAttr.setMax(1.0);
+    sMinProjectedLengthAttr = numericAttr.create("minProjectedLength", "mpl",
+                                                 MFnNumericData::kDouble, 0.0);
+    numericAttr.setMin(0.0);
+    sLodEyeAttr = numericAttr.createPoint("lodEye", "eye");
+
+    // consecutive branches bending less than this many degrees are meshed as one, 0 for off
+    sMergeAngleAttr = numericAttr.create("mergeAngle", "mga", MFnNumericData::kDouble, 0.5);
+    numericAttr.setMin(0.0);
+
+    // sides of every tube when fixed, the most the depth and length policies give
+    sSidesAttr = numericAttr.create("sides", "sds", MFnNumericData::kInt, MeshBuilder::k_SLICES);
+    numericAttr.setMin(MeshBuilder::k_MIN_SIDES);
+    numericAttr.setMax(MeshBuilder::k_MAX_SIDES);
+    sMaxTrianglesAttr = numericAttr.create("maxTriangles", "mtr", MFnNumericData::kInt, 1000000);
+    numericAttr.setMin(0);
+
+    MFnEnumAttribute enumAttr; // enum attribute creator
+    enumAttr.setCached(true);
+    sSidesPolicyAttr = enumAttr.create("sidesPolicy", "sdp",
+                                       static_cast<short>(MeshBuilder::SidesPolicy::Fixed));
+    enumAttr.addField("fixed", static_cast<short>(MeshBuilder::SidesPolicy::Fixed));
+    enumAttr.addField("depth", static_cast<short>(MeshBuilder::SidesPolicy::Depth));
+    enumAttr.addField("length", static_cast<short>(MeshBuilder::SidesPolicy::Length));
+    enumAttr.addField("budget", static_cast<short>(MeshBuilder::SidesPolicy::Budget));
     
     MFnUnitAttribute unitAttr; // unit attribute creator
     unitAttr.setCached(true);
@@ -58,6 +113,42 @@ MStatus LSystemNode::initialize()
     status = addAttribute(sAngleAttr);
     CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Add Angle Attribute");
 
+    status = addAttribute(sSeedAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Add Seed Attribute");
+
+    status = addAttribute(sMaxSymbolsAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Add Max Symbols Attribute");
+
+    status = addAttribute(sMaxBranchesAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Add Max Branches Attribute");
+
+    status = addAttribute(sMaxMemoryAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Add Max Memory Attribute");
+
+    status = addAttribute(sMaxDepthAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Add Max Depth Attribute");
+
+    status = addAttribute(sLeafFractionAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Add Leaf Fraction Attribute");
+
+    status = addAttribute(sMinProjectedLengthAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Add Min Projected Length Attribute");
+
+    status = addAttribute(sLodEyeAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Add LOD Eye Attribute");
+
+    status = addAttribute(sMergeAngleAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Add Merge Angle Attribute");
+
+    status = addAttribute(sSidesAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Add Sides Attribute");
+
+    status = addAttribute(sMaxTrianglesAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Add Max Triangles Attribute");
+
+    status = addAttribute(sSidesPolicyAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Add Sides Policy Attribute");
+
     status = addAttribute(sTimeAttr);
     CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Add Time Attribute");
 
@@ -71,6 +162,43 @@ MStatus LSystemNode::initialize()
     status = attributeAffects(sStepSizeAttr, sOutputMeshAttr);
     CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Connect Step Size & Output Mesh Attribute");
 
+    status = attributeAffects(sSeedAttr, sOutputMeshAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Connect Seed & Output Mesh Attribute");
+
+    status = attributeAffects(sMaxSymbolsAttr, sOutputMeshAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Connect Max Symbols & Output Mesh Attribute");
+
+    status = attributeAffects(sMaxBranchesAttr, sOutputMeshAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Connect Max Branches & Output Mesh Attribute");
+
+    status = attributeAffects(sMaxMemoryAttr, sOutputMeshAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Connect Max Memory & Output Mesh Attribute");
+
+    status = attributeAffects(sMaxDepthAttr, sOutputMeshAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Connect Max Depth & Output Mesh Attribute");
+
+    status = attributeAffects(sLeafFractionAttr, sOutputMeshAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Connect Leaf Fraction & Output Mesh Attribute");
+
+    status = attributeAffects(sMinProjectedLengthAttr, sOutputMeshAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status,
+                                        "Connect Min Projected Length & Output Mesh Attribute");
+
+    status = attributeAffects(sLodEyeAttr, sOutputMeshAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Connect LOD Eye & Output Mesh Attribute");
+
+    status = attributeAffects(sMergeAngleAttr, sOutputMeshAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Connect Merge Angle & Output Mesh Attribute");
+
+    status = attributeAffects(sSidesAttr, sOutputMeshAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Connect Sides & Output Mesh Attribute");
+
+    status = attributeAffects(sMaxTrianglesAttr, sOutputMeshAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Connect Max Triangles & Output Mesh Attribute");
+
+    status = attributeAffects(sSidesPolicyAttr, sOutputMeshAttr);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Connect Sides Policy & Output Mesh Attribute");
+
     status = attributeAffects(sGrammarAttr, sOutputMeshAttr);
     CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Connect Grammar & Output Mesh Attribute");
 
@@ -97,6 +225,30 @@ MStatus LSystemNode::compute(const MPlug& plug, MDataBlock& data)
     CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Query Angle Attribute Handle");
     MDataHandle stepHandle = data.inputValue(sStepSizeAttr, &status);
     CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Query Step Size Attribute Handle");
+    MDataHandle seedHandle = data.inputValue(sSeedAttr, &status);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Query Seed Attribute Handle");
+    MDataHandle maxSymbolsHandle = data.inputValue(sMaxSymbolsAttr, &status);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Query Max Symbols Attribute Handle");
+    MDataHandle maxBranchesHandle = data.inputValue(sMaxBranchesAttr, &status);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Query Max Branches Attribute Handle");
+    MDataHandle maxMemoryHandle = data.inputValue(sMaxMemoryAttr, &status);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Query Max Memory Attribute Handle");
+    MDataHandle maxDepthHandle = data.inputValue(sMaxDepthAttr, &status);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Query Max Depth Attribute Handle");
+    MDataHandle leafFractionHandle = data.inputValue(sLeafFractionAttr, &status);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Query Leaf Fraction Attribute Handle");
+    MDataHandle minProjectedLengthHandle = data.inputValue(sMinProjectedLengthAttr, &status);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Query Min Projected Length Attribute Handle");
+    MDataHandle lodEyeHandle = data.inputValue(sLodEyeAttr, &status);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Query LOD Eye Attribute Handle");
+    MDataHandle mergeAngleHandle = data.inputValue(sMergeAngleAttr, &status);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Query Merge Angle Attribute Handle");
+    MDataHandle sidesHandle = data.inputValue(sSidesAttr, &status);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Query Sides Attribute Handle");
+    MDataHandle maxTrianglesHandle = data.inputValue(sMaxTrianglesAttr, &status);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Query Max Triangles Attribute Handle");
+    MDataHandle sidesPolicyHandle = data.inputValue(sSidesPolicyAttr, &status);
+    CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Query Sides Policy Attribute Handle");
 
     MDataHandle timeHandle = data.inputValue(sTimeAttr, &status);
     CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Query Time Attribute Handle");
@@ -114,59 +266,130 @@ MStatus LSystemNode::compute(const MPlug& plug, MDataBlock& data)
         return status;
     }
 
-    static std::string grammar{ std::istreambuf_iterator<char>(fileStream),
-                                std::istreambuf_iterator<char>() };
+    std::string grammar{ std::istreambuf_iterator<char>(fileStream),
+                         std::istreambuf_iterator<char>() };
 
     double stepSize = stepHandle.asDouble();
     double angle = degreeHandle.asDouble();
+    int32_t seed = seedHandle.asInt();
+    int32_t maxSymbols = max(0, maxSymbolsHandle.asInt());
+    int32_t maxBranches = max(0, maxBranchesHandle.asInt());
+    int32_t maxMemory = max(0, maxMemoryHandle.asInt());
+    int32_t maxDepth = max(0, maxDepthHandle.asInt());
+    double leafFraction = leafFractionHandle.asDouble();
+    double minProjectedLength = minProjectedLengthHandle.asDouble();
+    const double3& eye = lodEyeHandle.asDouble3();
+    MPoint lodEye(eye[0], eye[1], eye[2]);
+    double mergeAngle = mergeAngleHandle.asDouble();
+    int32_t sides = sidesHandle.asInt();
+    int32_t maxTriangles = max(0, maxTrianglesHandle.asInt());
+    auto sidesPolicy = static_cast<MeshBuilder::SidesPolicy>(sidesPolicyHandle.asShort());
     int32_t time = floor(timeHandle.asTime().value());
     
-    if ((grammar != mGrammarCache) || mBranches.empty())
+    bool grammarChanged = (grammar != mGrammarCache) || mBranches.size() == 0;
+    if (grammarChanged)
     {
-        mSystem.loadProgramFromString(grammar.c_str()); // only load when necessary
+        // only load when necessary; iterations the edit didn't affect stay cached
+        mSystem.loadProgramFromString(grammar);
         mGrammarCache = grammar;
+        for (const std::string& error : mSystem.getErrors())
+        {
+            MGlobal::displayWarning(MString("Grammar: ") + error.c_str());
+        }
     }
 
     uint32_t iterations = max(1, time);
-    if ((iterations == mIterationsCache) && (angle == mAngleCache) && (stepSize == mStepSizeCache) && !mBranches.empty())
+    if (!grammarChanged && (iterations == mIterationsCache) && (angle == mAngleCache)
+        && (stepSize == mStepSizeCache) && (seed == mSeedCache) && (maxSymbols == mMaxSymbolsCache)
+        && (maxBranches == mMaxBranchesCache) && (maxMemory == mMaxMemoryCache)
+        && (maxDepth == mMaxDepthCache) && (leafFraction == mLeafFractionCache)
+        && (minProjectedLength == mMinProjectedLengthCache) && (lodEye == mLodEyeCache)
+        && (mergeAngle == mMergeAngleCache) && (sides == mSidesCache)
+        && (maxTriangles == mMaxTrianglesCache) && (sidesPolicy == mSidesPolicyCache))
     {
         return MStatus::kSuccess; // prevent re-process if no attributes have changed
     }
         
     mSystem.setDefaultAngle(angle);
     mSystem.setDefaultStep(stepSize);
+    mSystem.setSeed(static_cast<uint32_t>(seed));
+    // only the iteration last derived in memory stays resident for the next grammar edit to reuse
+    mSystem.setCachePolicy(LSystem::CachePolicy::KeepLatest);
+    mSystem.setBudget({ static_cast<uint64_t>(maxSymbols), static_cast<uint64_t>(maxBranches),
+                        static_cast<size_t>(maxMemory) << 20 });
+    mSystem.setDetail({ vec3(lodEye.x, lodEye.y, lodEye.z), static_cast<float>(minProjectedLength),
+                        static_cast<unsigned int>(maxDepth), static_cast<float>(leafFraction) });
     
-    mSystem.process(iterations, mBranches);
+    mBranches.clear(); // process() reserves the predicted branch count up front
+    LSystem::InstanceHierarchy hierarchy;
+    bool withDepth = sidesPolicy == MeshBuilder::SidesPolicy::Depth; // flattening drops depths
+    if (!withDepth && mSystem.process(iterations, hierarchy))
+    {
+        hierarchy.flatten(mBranches); // every distinct subtree is interpreted only once; no LOD
+    }
+    else
+    {
+        mSystem.process(iterations, mBranches, withDepth); // streams unless it needs the string
+    }
+
+    const LSystem::Result& result = mSystem.getLastResult();
+    if (result.status == LSystem::Status::UnbalancedBrackets)
+    {
+        MGlobal::displayWarning("Unbalanced brackets in the derived string, nothing is drawn");
+    }
+    else if (result.truncated)
+    {
+        MString message("Branch budget reached while drawing iteration ");
+        message += result.iteration;
+        message += ", showing the branches drawn until then";
+        MGlobal::displayWarning(message);
+    }
+    else if (!result.ok())
+    {
+        MString message("Budget exceeded at iteration ");
+        message += result.iteration + 1;
+        message += result.iteration < 0 ? ", nothing fits" : ", showing the one before";
+        MGlobal::displayWarning(message);
+    }
 
     mIterationsCache = iterations;
     mStepSizeCache = stepSize;
     mAngleCache = angle;
-
-    mPoints.clear();
-    mFaceCounts.clear();
-    mFaceConnects.clear();
+    mSeedCache = seed;
+    mMaxSymbolsCache = maxSymbols;
+    mMaxBranchesCache = maxBranches;
+    mMaxMemoryCache = maxMemory;
+    mMaxDepthCache = maxDepth;
+    mLeafFractionCache = leafFraction;
+    mMinProjectedLengthCache = minProjectedLength;
+    mLodEyeCache = lodEye;
+    mMergeAngleCache = mergeAngle;
+    mSidesCache = sides;
+    mMaxTrianglesCache = maxTriangles;
+    mSidesPolicyCache = sidesPolicy;
+
+    const LSystem::BranchBuffers* meshed = &mBranches;
+    if (mergeAngle > 0.0)
+    {
+        mBranches.mergeCollinear(static_cast<float>(mergeAngle), mMergedBranches);
+        meshed = &mMergedBranches;
+    }
+    mMeshBuilder.setSides(sidesPolicy, sides, static_cast<uint64_t>(maxTriangles));
+    mMeshBuilder.buildTubes(*meshed, mMesh); // every array sized once, no per-branch appends
     
     MFnMeshData meshDataFn;
 
     MObject mesh = meshDataFn.create(&status);
     CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Create New Mesh");
 
-    MPoint startPoint;
-    MPoint endPoint;
-    for (int i = 0; i < mBranches.size(); i++)
-    {
-        const vec3& start = mBranches[i].first;
-        const vec3& end = mBranches[i].second;
-
-        startPoint = MPoint(start.n);
-        endPoint = MPoint(end.n);
-
-        CylinderMesh cylinder = CylinderMesh(startPoint, endPoint);
-        cylinder.appendToMesh(mPoints, mFaceCounts, mFaceConnects);
-    }
+    MFloatPointArray points(reinterpret_cast<const float(*)[4]>(mMesh.points.data()),
+                            mMesh.numVertices());
+    MIntArray faceCounts(mMesh.faceCounts.data(), mMesh.numFaces());
+    MIntArray faceConnects(mMesh.faceConnects.data(),
+                           static_cast<unsigned int>(mMesh.faceConnects.size()));
 
     MFnMesh meshFn;
-    meshFn.create(mPoints.length(), mFaceCounts.length(), mPoints, mFaceCounts, mFaceConnects, mesh,
+    meshFn.create(points.length(), faceCounts.length(), points, faceCounts, faceConnects, mesh,
                   &status);
     CHECK_MSTATUS_AND_RETURN_IT_VERBOSE(status, "Populate Mesh");
     
@@ -1,6 +1,6 @@
 #pragma once
 
-#include <maya/MPointArray.h>
+#include <maya/MPoint.h>
 #include <maya/MFnMesh.h>
 #include <maya/MPxNode.h>
 #include <maya/MObject.h>
@@ -8,6 +8,7 @@
 #include <maya/MDataBlock.h>
 
 #include "LSystem.h"
+#include "mesh.h"
 
 class LSystemNode : public MPxNode
 {
@@ -32,21 +33,46 @@ public:
     // numeric attributes
     static MObject sStepSizeAttr;
     static MObject sAngleAttr;
+    static MObject sSeedAttr;
+    static MObject sMaxSymbolsAttr;
+    static MObject sMaxBranchesAttr;
+    static MObject sMaxMemoryAttr;
+    static MObject sMaxDepthAttr;
+    static MObject sLeafFractionAttr;
+    static MObject sMinProjectedLengthAttr;
+    static MObject sLodEyeAttr;
+    static MObject sMergeAngleAttr;
+    static MObject sSidesAttr;
+    static MObject sMaxTrianglesAttr;
+
+    // enum attributes
+    static MObject sSidesPolicyAttr;
 
     // unit attributes
     static MObject sTimeAttr;
 
 private:
     LSystem mSystem;
-    std::vector<LSystem::Branch> mBranches;
-
-    MPointArray mPoints;
-    MIntArray mFaceCounts;
-    MIntArray mFaceConnects;
+    LSystem::BranchBuffers mBranches;
+    LSystem::BranchBuffers mMergedBranches;  // mBranches with collinear runs merged
+    MeshBuilder mMeshBuilder;
+    MeshBuilder::Mesh mMesh;  // kept between computes so its arrays are only grown
 
     // cached grammar string to prevent system from reloading every frame
     std::string mGrammarCache;
     uint32_t mIterationsCache;
     double mAngleCache;
     double mStepSizeCache;
+    int32_t mSeedCache;
+    int32_t mMaxSymbolsCache;
+    int32_t mMaxBranchesCache;
+    int32_t mMaxMemoryCache;
+    int32_t mMaxDepthCache;
+    double mLeafFractionCache;
+    double mMinProjectedLengthCache;
+    MPoint mLodEyeCache;
+    double mMergeAngleCache;
+    int32_t mSidesCache;
+    int32_t mMaxTrianglesCache;
+    MeshBuilder::SidesPolicy mSidesPolicyCache;
 };